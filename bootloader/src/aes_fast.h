@@ -0,0 +1,23 @@
+#ifndef AES_FAST_H
+#define AES_FAST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bearssl.h"
+
+#define AES_FAST_ROUNDS 10 // AES-128 only
+
+// Same shape as the BearSSL CTR contexts, the vtable comes first
+typedef struct {
+  const br_block_ctr_class *vtable;
+  uint32_t skey[4 * (AES_FAST_ROUNDS + 1)];
+} aes_fast_ctr_keys;
+
+// Drop-in for br_aes_*_ctr_vtable, for 16 byte keys
+extern const br_block_ctr_class aes_fast_ctr_vtable;
+
+void aes_fast_ctr_init(aes_fast_ctr_keys *ctx, const void *key, size_t len);
+uint32_t aes_fast_ctr_run(const aes_fast_ctr_keys *ctx, const void *iv, uint32_t cc, void *data, size_t len);
+
+#endif //AES_FAST_H
@@ -0,0 +1,412 @@
+// Hardware Imports
+#include "inc/hw_memmap.h" // Peripheral Base Addresses
+#include "inc/hw_types.h" // Boolean type
+
+// Driver API Imports
+#include "driverlib/sysctl.h" // System control API (clock/reset)
+#include "driverlib/systick.h" // SysTick timer API
+
+// Application Imports
+#include "uart.h"
+
+// Cryptography
+#include "bearssl.h"
+#include "crypto_backend.h" // What the bootloader is built with
+
+// Keys
+#include "secrets.h"
+
+// Only for memcmp(), memcpy() and strcmp()
+#include<string.h>
+
+/*
+ * Crypto throughput benchmark.
+ * Times every AES-CTR and GHASH implementation BearSSL has for this core and
+ * our own, the whole GCM decrypt of a frame, both SHA-256 implementations and
+ * HMAC-SHA256, over one page of data, the unit the bootloader works in.
+ * Results go out over UART2 as cycles per page and bytes per 1000 cycles.
+ * Known answer tests run first, the numbers mean nothing if one fails.
+ *
+ * Build with make bench and run gcc/bench.axf with bl_emulate.py --boot-path.
+ * Cycles are counted with SysTick, so under QEMU they are only as good as
+ * its emulated clock: compare the backends against each other, not the numbers
+ * against real hardware.
+ */
+
+#define BENCH_SIZE 1024 // One page
+#define BENCH_RUNS 16
+#define SYSTICK_PERIOD 0x1000000 // Full 24 bit counter, a page takes far less
+#define AESKEY_SIZE 16
+
+// Data every backend runs over
+unsigned char bench_buf[BENCH_SIZE];
+
+// Room for any of the AES-CTR contexts
+typedef union {
+  const br_block_ctr_class *vtable;
+  br_aes_ct_ctr_keys ct;
+  br_aes_small_ctr_keys small;
+  br_aes_big_ctr_keys big;
+  aes_fast_ctr_keys fast;
+} bench_aes_keys;
+
+const br_block_ctr_class *const aes_impls[] = {
+  &br_aes_ct_ctr_vtable,
+  &br_aes_small_ctr_vtable,
+  &br_aes_big_ctr_vtable,
+  &aes_fast_ctr_vtable,
+};
+const char *const aes_names[] = {"aes_ct", "aes_small", "aes_big", "aes_fast"};
+
+const br_ghash ghash_impls[] = {
+  br_ghash_ctmul,
+  br_ghash_ctmul32,
+  br_ghash_ctmul64,
+  ghash_4bit,
+};
+const char *const ghash_names[] = {"ghash_ctmul", "ghash_ctmul32", "ghash_ctmul64", "ghash_4bit"};
+
+const br_hash_class *const sha_impls[] = {
+  &br_sha256_vtable,
+  &sha256_fast_vtable,
+};
+const char *const sha_names[] = {"sha256_bearssl", "sha256_fast"};
+
+// Known answers, FIPS 180-2 and RFC 4231 test case 2
+#define KAT_LONG "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"
+#define KAT_HMAC_KEY "Jefe"
+#define KAT_HMAC_DATA "what do ya want for nothing?"
+const unsigned char kat_empty[32] = {
+  0xe3, 0xb0, 0xc4, 0x42, 0x98, 0xfc, 0x1c, 0x14, 0x9a, 0xfb, 0xf4, 0xc8, 0x99, 0x6f, 0xb9, 0x24,
+  0x27, 0xae, 0x41, 0xe4, 0x64, 0x9b, 0x93, 0x4c, 0xa4, 0x95, 0x99, 0x1b, 0x78, 0x52, 0xb8, 0x55,
+};
+const unsigned char kat_abc[32] = {
+  0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+  0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad,
+};
+const unsigned char kat_long[32] = {
+  0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+  0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1,
+};
+const unsigned char kat_hmac[32] = {
+  0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e, 0x6a, 0x04, 0x24, 0x26, 0x08, 0x95, 0x75, 0xc7,
+  0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27, 0x39, 0x83, 0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43,
+};
+
+// FIPS 197 appendix C.1, the plaintext block is used as counter block iv || cc
+const unsigned char kat_aes_key[16] = {
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+};
+const unsigned char kat_aes_iv[12] = {
+  0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb,
+};
+#define KAT_AES_CC 0xccddeeff
+const unsigned char kat_aes_ct[16] = {
+  0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a,
+};
+
+// GCM specification test case 4, partial last block and AAD included
+const unsigned char kat_gcm_key[16] = {
+  0xfe, 0xff, 0xe9, 0x92, 0x86, 0x65, 0x73, 0x1c, 0x6d, 0x6a, 0x8f, 0x94, 0x67, 0x30, 0x83, 0x08,
+};
+const unsigned char kat_gcm_iv[12] = {
+  0xca, 0xfe, 0xba, 0xbe, 0xfa, 0xce, 0xdb, 0xad, 0xde, 0xca, 0xf8, 0x88,
+};
+const unsigned char kat_gcm_aad[20] = {
+  0xfe, 0xed, 0xfa, 0xce, 0xde, 0xad, 0xbe, 0xef, 0xfe, 0xed, 0xfa, 0xce, 0xde, 0xad, 0xbe, 0xef,
+  0xab, 0xad, 0xda, 0xd2,
+};
+const unsigned char kat_gcm_pt[60] = {
+  0xd9, 0x31, 0x32, 0x25, 0xf8, 0x84, 0x06, 0xe5, 0xa5, 0x59, 0x09, 0xc5, 0xaf, 0xf5, 0x26, 0x9a,
+  0x86, 0xa7, 0xa9, 0x53, 0x15, 0x34, 0xf7, 0xda, 0x2e, 0x4c, 0x30, 0x3d, 0x8a, 0x31, 0x8a, 0x72,
+  0x1c, 0x3c, 0x0c, 0x95, 0x95, 0x68, 0x09, 0x53, 0x2f, 0xcf, 0x0e, 0x24, 0x49, 0xa6, 0xb5, 0x25,
+  0xb1, 0x6a, 0xed, 0xf5, 0xaa, 0x0d, 0xe6, 0x57, 0xba, 0x63, 0x7b, 0x39,
+};
+const unsigned char kat_gcm_ct[60] = {
+  0x42, 0x83, 0x1e, 0xc2, 0x21, 0x77, 0x74, 0x24, 0x4b, 0x72, 0x21, 0xb7, 0x84, 0xd0, 0xd4, 0x9c,
+  0xe3, 0xaa, 0x21, 0x2f, 0x2c, 0x02, 0xa4, 0xe0, 0x35, 0xc1, 0x7e, 0x23, 0x29, 0xac, 0xa1, 0x2e,
+  0x21, 0xd5, 0x14, 0xb2, 0x54, 0x66, 0x93, 0x1c, 0x7d, 0x8f, 0x6a, 0x5a, 0xac, 0x84, 0xaa, 0x05,
+  0x1b, 0xa3, 0x0b, 0x39, 0x6a, 0x0a, 0xac, 0x97, 0x3d, 0x58, 0xe0, 0x91,
+};
+const unsigned char kat_gcm_tag[16] = {
+  0x5b, 0xc9, 0x4f, 0xbc, 0x32, 0x21, 0xa5, 0xdb, 0x94, 0xfa, 0xe9, 0x5a, 0xe7, 0x12, 0x1a, 0x47,
+};
+
+// Frame metadata stand in for the GCM benchmark
+#define BENCH_AAD_SIZE 6
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+/*
+ * Writes an unsigned number in decimal to UART2
+ */
+void write_dec(uint32_t n){
+  char digits[11];
+  int i = sizeof(digits) - 1;
+  
+  digits[i] = '\0';
+  do {
+    digits[--i] = '0' + n % 10;
+    n /= 10;
+  } while(n);
+  uart_write_str(UART2, digits + i);
+  return;
+}
+
+/*
+ * Cycles between two SysTick readings, it counts down
+ */
+uint32_t elapsed(uint32_t start, uint32_t end){
+  return (start - end) & (SYSTICK_PERIOD - 1);
+}
+
+/*
+ * Reports one result as a line on UART2
+ */
+void report(const char *name, uint32_t cycles, int selected){
+  uint32_t per_page = cycles / BENCH_RUNS;
+  uint32_t per_kcycle = cycles ? (uint32_t) ((uint64_t) BENCH_SIZE * BENCH_RUNS * 1000 / cycles) : 0;
+  
+  uart_write_str(UART2, (char *) name);
+  uart_write_str(UART2, ": ");
+  write_dec(per_page);
+  uart_write_str(UART2, " cycles/page, ");
+  write_dec(per_kcycle);
+  uart_write_str(UART2, " bytes/kcycle");
+  if(selected)
+    uart_write_str(UART2, " (built in)");
+  uart_write_str(UART2, "\n");
+  return;
+}
+
+/*
+ * Hashes len bytes of data with impl and compares against expect
+ */
+int sha_kat(const br_hash_class *impl, const char *data, size_t len, const unsigned char *expect){
+  br_hash_compat_context hc;
+  unsigned char out[32];
+  
+  impl->init(&hc.vtable);
+  // In two pieces, so the buffering is tested as well
+  impl->update(&hc.vtable, data, len / 2);
+  impl->update(&hc.vtable, data + len / 2, len - len / 2);
+  impl->out(&hc.vtable, out);
+  return !memcmp(out, expect, sizeof(out));
+}
+
+/*
+ * HMAC test case with impl as the hash
+ */
+int hmac_kat(const br_hash_class *impl){
+  br_hmac_key_context kc;
+  br_hmac_context ctx;
+  unsigned char out[32];
+  
+  br_hmac_key_init(&kc, impl, KAT_HMAC_KEY, sizeof(KAT_HMAC_KEY) - 1);
+  br_hmac_init(&ctx, &kc, 0);
+  br_hmac_update(&ctx, KAT_HMAC_DATA, sizeof(KAT_HMAC_DATA) - 1);
+  br_hmac_out(&ctx, out);
+  return !memcmp(out, kat_hmac, sizeof(out));
+}
+
+/*
+ * Reports one known answer test result as a line on UART2
+ */
+void kat_result(const char *name, int pass){
+  uart_write_str(UART2, "KAT ");
+  uart_write_str(UART2, (char *) name);
+  uart_write_str(UART2, pass ? ": pass\n" : ": FAIL\n");
+  return;
+}
+
+/*
+ * Runs the known answer tests of one SHA-256 implementation.
+ * Also checks it agrees with BearSSL's over the benchmark data.
+ */
+int sha_kats(const br_hash_class *impl){
+  br_hash_compat_context hc;
+  unsigned char ours[32], stock[32];
+  
+  int pass = sha_kat(impl, "", 0, kat_empty)
+    && sha_kat(impl, "abc", 3, kat_abc)
+    && sha_kat(impl, KAT_LONG, sizeof(KAT_LONG) - 1, kat_long)
+    && hmac_kat(impl);
+  
+  impl->init(&hc.vtable);
+  impl->update(&hc.vtable, bench_buf, BENCH_SIZE);
+  impl->out(&hc.vtable, ours);
+  br_sha256_vtable.init(&hc.vtable);
+  br_sha256_vtable.update(&hc.vtable, bench_buf, BENCH_SIZE);
+  br_sha256_vtable.out(&hc.vtable, stock);
+  return pass && !memcmp(ours, stock, sizeof(ours));
+}
+
+/*
+ * One AES block through CTR mode with aes
+ */
+int aes_kat(const br_block_ctr_class *aes){
+  bench_aes_keys keys;
+  unsigned char block[16] = {0};
+  
+  aes->init(&keys.vtable, kat_aes_key, sizeof(kat_aes_key));
+  aes->run(&keys.vtable, kat_aes_iv, KAT_AES_CC, block, sizeof(block));
+  return !memcmp(block, kat_aes_ct, sizeof(block));
+}
+
+/*
+ * Decrypts and verifies the GCM test case the way gcm_decrypt_and_verify() does
+ */
+int gcm_kat(const br_block_ctr_class *aes, br_ghash gh){
+  bench_aes_keys keys;
+  br_gcm_context gc;
+  unsigned char buf[sizeof(kat_gcm_ct)];
+  
+  aes->init(&keys.vtable, kat_gcm_key, sizeof(kat_gcm_key));
+  br_gcm_init(&gc, &keys.vtable, gh);
+  br_gcm_reset(&gc, kat_gcm_iv, sizeof(kat_gcm_iv));
+  br_gcm_aad_inject(&gc, kat_gcm_aad, sizeof(kat_gcm_aad));
+  br_gcm_flip(&gc);
+  memcpy(buf, kat_gcm_ct, sizeof(buf));
+  br_gcm_run(&gc, 0, buf, sizeof(buf));
+  return br_gcm_check_tag(&gc, kat_gcm_tag) && !memcmp(buf, kat_gcm_pt, sizeof(buf));
+}
+
+/*
+ * AES-CTR over one page, the key schedule is set up outside the timing
+ */
+uint32_t bench_aes(const br_block_ctr_class *impl){
+  bench_aes_keys keys;
+  unsigned char iv[12] = {0};
+  uint32_t cycles = 0;
+  
+  impl->init(&keys.vtable, aes_key, AESKEY_SIZE);
+  for(int i = 0; i < BENCH_RUNS; i++){
+    uint32_t start = SysTickValueGet();
+    impl->run(&keys.vtable, iv, 0, bench_buf, BENCH_SIZE);
+    cycles += elapsed(start, SysTickValueGet());
+  }
+  return cycles;
+}
+
+/*
+ * GHASH over one page
+ */
+uint32_t bench_ghash(br_ghash impl){
+  unsigned char y[16] = {0};
+  uint32_t cycles = 0;
+  
+  // Lets a keyed implementation build its table first, it does once per boot
+  impl(y, gcm_h, bench_buf, 0);
+  for(int i = 0; i < BENCH_RUNS; i++){
+    uint32_t start = SysTickValueGet();
+    impl(y, gcm_h, bench_buf, BENCH_SIZE);
+    cycles += elapsed(start, SysTickValueGet());
+  }
+  return cycles;
+}
+
+/*
+ * A whole frame through AES-GCM, like gcm_decrypt_and_verify() minus the tag
+ */
+uint32_t bench_gcm(const br_block_ctr_class *aes, br_ghash gh){
+  bench_aes_keys keys;
+  br_gcm_context gc;
+  unsigned char iv[12] = {0};
+  unsigned char tag[16];
+  uint32_t cycles = 0;
+  
+  aes->init(&keys.vtable, aes_key, AESKEY_SIZE);
+  br_gcm_init(&gc, &keys.vtable, gh);
+  for(int i = 0; i < BENCH_RUNS; i++){
+    uint32_t start = SysTickValueGet();
+    br_gcm_reset(&gc, iv, sizeof(iv));
+    br_gcm_aad_inject(&gc, bench_buf, BENCH_AAD_SIZE);
+    br_gcm_flip(&gc);
+    br_gcm_run(&gc, 0, bench_buf, BENCH_SIZE);
+    br_gcm_get_tag(&gc, tag);
+    cycles += elapsed(start, SysTickValueGet());
+  }
+  return cycles;
+}
+
+/*
+ * Plain SHA-256 over one page
+ */
+uint32_t bench_sha(const br_hash_class *impl){
+  br_hash_compat_context hc;
+  unsigned char out[32];
+  uint32_t cycles = 0;
+  
+  for(int i = 0; i < BENCH_RUNS; i++){
+    uint32_t start = SysTickValueGet();
+    impl->init(&hc.vtable);
+    impl->update(&hc.vtable, bench_buf, BENCH_SIZE);
+    impl->out(&hc.vtable, out);
+    cycles += elapsed(start, SysTickValueGet());
+  }
+  return cycles;
+}
+
+/*
+ * HMAC-SHA256 over one page, from the precomputed key states like hmac_start()
+ */
+uint32_t bench_hmac(void){
+  br_hmac_context ctx;
+  unsigned char out[32];
+  uint32_t cycles = 0;
+  
+  for(int i = 0; i < BENCH_RUNS; i++){
+    uint32_t start = SysTickValueGet();
+    br_hmac_init(&ctx, &hmac_key_ctx, 0);
+    br_hmac_update(&ctx, bench_buf, BENCH_SIZE);
+    br_hmac_out(&ctx, out);
+    cycles += elapsed(start, SysTickValueGet());
+  }
+  return cycles;
+}
+
+int main(void){
+  uart_init(UART2);
+  
+  SysTickPeriodSet(SYSTICK_PERIOD);
+  SysTickEnable();
+  
+  for(int i = 0; i < BENCH_SIZE; i++)
+    bench_buf[i] = (unsigned char) i;
+  
+  uart_write_str(UART2, "Crypto benchmark, ");
+  write_dec(BENCH_RUNS);
+  uart_write_str(UART2, " runs of ");
+  write_dec(BENCH_SIZE);
+  uart_write_str(UART2, " bytes at ");
+  write_dec(SysCtlClockGet());
+  uart_write_str(UART2, " Hz\n");
+  
+  for(unsigned i = 0; i < COUNT(sha_impls); i++)
+    kat_result(sha_names[i], sha_kats(sha_impls[i]));
+  
+  // AES alone and under GCM with a reference GHASH, then the other way around
+  for(unsigned i = 0; i < COUNT(aes_impls); i++)
+    kat_result(aes_names[i], aes_kat(aes_impls[i]) && gcm_kat(aes_impls[i], br_ghash_ctmul32));
+  for(unsigned i = 0; i < COUNT(ghash_impls); i++)
+    kat_result(ghash_names[i], gcm_kat(&br_aes_ct_ctr_vtable, ghash_impls[i]));
+  
+  for(unsigned i = 0; i < COUNT(aes_impls); i++)
+    report(aes_names[i], bench_aes(aes_impls[i]), !strcmp(aes_names[i], AES_BACKEND_NAME));
+  
+  for(unsigned i = 0; i < COUNT(ghash_impls); i++)
+    report(ghash_names[i], bench_ghash(ghash_impls[i]), ghash_impls[i] == ghash_backend);
+  
+  // The decrypt path a frame takes, BearSSL's constant time pair against ours
+  report("gcm_aes_ct_ctmul32", bench_gcm(&br_aes_ct_ctr_vtable, br_ghash_ctmul32), 0);
+  report("gcm_aes_fast_4bit", bench_gcm(&aes_fast_ctr_vtable, ghash_4bit), 0);
+  
+  for(unsigned i = 0; i < COUNT(sha_impls); i++)
+    report(sha_names[i], bench_sha(sha_impls[i]), sha_impls[i] == &sha256_backend);
+  
+  report("hmac_sha256", bench_hmac(), 1);
+  
+  uart_write_str(UART2, "Done\n");
+  while(1){
+  }
+}
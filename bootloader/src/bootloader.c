@@ -8,41 +8,74 @@
 #include "driverlib/flash.h" // FLASH API
 #include "driverlib/sysctl.h" // System control API (clock/reset)
 #include "driverlib/interrupt.h" // Interrupt API
+#include "driverlib/uart.h" // UART configuration API
 
 // Application Imports
 #include "uart.h"
+#include "uart_rx.h" // Interrupt driven UART1 receive
+#include "flash_pipe.h" // Background flash programming
+#include "profile.h" // Cycle counts per update phase, with make PROFILE=1
 
 // Cryptography
 #include "bearssl.h"
+#include "crypto_backend.h" // AES, GHASH and SHA-256 implementations picked at build time
 
 // Keys
 #include "secrets.h"
 
 // Only for ceil()
 #include<math.h>
+// Only for memcmp()
+#include<string.h>
 
 // Forward Declarations
 void load_initial_firmware(void);
-void load_firmware(void);
+void load_firmware(uint8_t window, int resume);
 void boot_firmware(void);
 long program_flash(uint32_t, unsigned char*, unsigned int);
 void print_bolt(void);
 void send_err(void);
-int check_read(int read);
+void send_frame_ack(uint16_t index, uint8_t window);
+void negotiate_baud(void);
+void set_uart1_baud(uint32_t baud);
+int wait_for_bytes(uint32_t count, uint32_t ms);
 void uart_read_variable(uint8_t uart, int blocking, char *da, int length);
-int gcm_decrypt_and_verify(char* ct, int ct_len);
+void gcm_init(void);
+void stream_nonce(char *nonce, const char *prefix, uint16_t index, int last);
+int gcm_decrypt_and_verify(char* ct, int ct_len, const char* nonce, const char* aad, int aad_len);
+void hmac_start(br_hmac_context *ctx);
+int hmac_check(br_hmac_context *ctx);
 int sha_hmac(char* data, int len);
+void mark_install_started(void);
+uint16_t journal_resume_point(const char *header);
+void journal_start(void);
+void journal_page_done(uint32_t pg);
+void stage_init(uint32_t size, int ahead);
+int stage_commit(uint32_t pg);
+int stage_write(const unsigned char *d, uint32_t n);
+int patch_copy(uint32_t src, uint32_t len);
+int patch_feed(const unsigned char *d, uint32_t n);
+int lz_feed(const unsigned char *d, uint32_t n);
+int page_needed(uint32_t pg);
+int page_manifest(uint16_t size, const char *nonce_prefix);
 
 // Firmware Constants
 #define METADATA_BASE 0xFC00  // Base address of version and firmware size in Flash
 #define RELEASE_BASE 0xF800 // Base address of release message
+#define JOURNAL_BASE 0xF400 // Base address of the transfer journal of an unfinished update
 #define FW_BASE 0x10000  // Base address of firmware in Flash
 #define FR_METADATA_SIZE 6
 #define FW_METADATA_SIZE 6
 #define FW_MAX_SIZE 0x7800 // Hard cap to firmware size at 30 KB
 #define RELEASE_MAX_SIZE 0x400 // Hard cap to release message size at 1KB
-#define DATA_SIZE (FW_MAX_SIZE + FW_METADATA_SIZE + RELEASE_MAX_SIZE) // Max is 31750 bytes
-// Firmware, release message and firmware metadata will be kept in data at one point.
+#define XFER_INFO_SIZE 5 // Payload encoding, payload size and base version
+#define FW_HEADER_SIZE (FW_METADATA_SIZE + NONCE_PREFIX_SIZE + XFER_INFO_SIZE)
+
+// Journal layout: header of the update | magic | one word per committed page
+#define JOURNAL_MAGIC 0x4C4E524A // "JRNL", programmed last so a torn record is ignored
+#define JOURNAL_MAGIC_OFFSET 20 // Header rounded up to a whole word
+#define JOURNAL_PAGES_OFFSET 24
+#define JOURNAL_PAGE_DONE 0x00000000
 
 // FLASH Constants
 #define FLASH_PAGESIZE 1024
@@ -52,23 +85,103 @@ int sha_hmac(char* data, int len);
 #define HMAC_SIZE 32
 #define TAG_SIZE 16
 #define AESKEY_SIZE 16
-#define IV_SIZE 16
+#define NONCE_SIZE 12 // GCM nonce of each frame
+#define NONCE_PREFIX_SIZE 7 // Random per update, the rest is frame index and last flag
 
 // Protocol Constants
 #define OK    ((unsigned char)0x00)
 #define ERROR ((unsigned char)0x01)
 #define UPDATE ((unsigned char)'U')
 #define BOOT ((unsigned char)'B')
+#define WINDOW ((unsigned char)'W')
+#define BAUD ((unsigned char)'R')
+#define RESUME ((unsigned char)'J')
+#define PROFILE_DUMP ((unsigned char)'P')
+#define BAUD_CONFIRM ((unsigned char)'C')
+
+// Payload encodings
+#define ENC_RAW 0 // Frames carry the image itself
+#define ENC_DELTA 1 // Frames carry a patch against the installed image
+#define ENC_LZ 2 // Frames carry the image compressed with LZSS
+#define ENC_PAGES 3 // Frames carry the image, but only the pages that differ from flash
+
+// Page manifest, one HMAC of every page of the new image with its index and the nonce prefix
+#define PAGES_MAX (FW_MAX_SIZE / FLASH_PAGESIZE)
+#define PAGE_BITMAP_SIZE ((PAGES_MAX + 7) / 8)
+
+// LZSS constants, a match may reach back at most one page
+#define LZ_WINDOW FLASH_PAGESIZE
+#define LZ_OFFSET_BITS 10
+#define LZ_MIN_MATCH 3
+
+// Patch ops
+#define PATCH_NONE 0x00 // Between ops
+#define PATCH_COPY 0x01 // 2b offset into the installed image, 2b length
+#define PATCH_ADD 0x02 // 2b length, followed by that many new bytes
+
+// Sliding window constants
+#define FRAME_MAX_SIZE (FR_METADATA_SIZE + HMAC_SIZE + FLASH_PAGESIZE + HMAC_SIZE + TAG_SIZE)
+// While one frame is verified the others in flight wait in the UART1 ring
+#define WINDOW_MAX (UART_RX_SIZE / FRAME_MAX_SIZE + 1)
+
+// Baud rate constants
+#define BAUD_DEFAULT 115200 // What uart_init() sets up and what a reset goes back to
+#define BAUD_TIMEOUT_MS 500 // How long the host has to prove a new rate works
+#define BAUD_PROBE_SIZE 4
 
 // Firmware v2 is embedded in bootloader
 extern int _binary_firmware_bin_start;
 extern int _binary_firmware_bin_size;
 
+// Sent by the host at a new baud rate and echoed back to prove both ends agree
+const unsigned char baud_probe[BAUD_PROBE_SIZE] = {0x55, 0xAA, 0x0F, 0xF0};
+
+// Current UART1 baud rate
+uint32_t uart1_baud = BAUD_DEFAULT;
+
 // Device metadata
 unsigned char fw_release_message[RELEASE_MAX_SIZE];
 
-// Data buffer
-unsigned char data[DATA_SIZE];
+// Frame buffer, one page of payload with its frame metadata behind it
+unsigned char frame[FLASH_PAGESIZE + FR_METADATA_SIZE];
+
+// Pages of the new image as they are put together.
+// They alternate, so one is filled while the other is flashed.
+unsigned char page_buf[2][FLASH_PAGESIZE];
+uint32_t out_len = 0; // Bytes of the new image so far
+uint32_t out_size = 0; // Size of the new image
+int erase_ahead = 0; // Whether the next page may be erased before it is filled
+int install_started = 0; // Whether a page of the old image was replaced yet
+
+// HMAC of the new image so far, absorbed page by page as they are committed.
+// The whole-image HMAC and the big MAC both start with the image, so one context serves both.
+br_hmac_context image_mac;
+
+// Pages of the new image that have to be sent, with ENC_PAGES the rest already are in flash
+int skip_pages = 0;
+uint8_t pages_needed[PAGE_BITMAP_SIZE];
+
+// Patch parser, ops may be split across frames
+uint8_t patch_op = PATCH_NONE;
+uint8_t patch_args[4];
+uint32_t patch_have = 0; // Argument bytes of patch_op read so far
+uint32_t patch_left = 0; // New bytes of a PATCH_ADD still to come
+uint32_t base_size = 0; // Size of the installed image the patch reads from
+
+// LZSS decoder, tokens may be split across frames
+uint8_t lz_flags = 0; // Which of the next items are literals
+uint8_t lz_items = 0; // Items left under lz_flags
+uint8_t lz_low = 0; // First byte of a match token
+uint8_t lz_have_low = 0;
+
+// Transfer journal, only raw updates are journaled since every frame is one page
+int journal_on = 0;
+const char *journal_id; // Header of the update being journaled
+uint32_t journal_pages = 0; // Pages the journal says are in flash
+
+// Decryption contexts, kept off the small stack
+aes_ctr_keys aes_ctx;
+br_gcm_context gcm_ctx;
 
 int main(void) {
   // Initialize UART channels
@@ -78,6 +191,14 @@ int main(void) {
   uart_init(UART0);
   uart_init(UART1);
   uart_init(UART2);
+  
+  // UART1 is received by interrupt, so it keeps draining while we verify
+  uart_rx_init();
+  
+  // Pages are flashed in the background while the next frame arrives
+  flash_pipe_init();
+  
+  PROF_INIT();
 
   // Enable UART0 interrupt
   IntEnable(INT_UART0);
@@ -89,15 +210,42 @@ int main(void) {
   uart_write_str(UART2, "Send \"U\" to update, and \"B\" to run the firmware.\n");
   uart_write_str(UART2, "Writing 0x20 to UART0 will reset the device.\n");
 
-  int resp;
   while (1){
-    uint32_t instruction = uart_read(UART1, BLOCKING, &resp);
+    uint32_t instruction = uart_rx_read_byte();
     if (instruction == UPDATE){
       uart_write_str(UART1, "U");
-      load_firmware();
+      load_firmware(1, 0);
+    } else if (instruction == WINDOW){
+      // Host proposes how many frames it wants in flight, we grant at most WINDOW_MAX
+      uint8_t window = uart_rx_read_byte();
+      if(window > WINDOW_MAX)
+        window = WINDOW_MAX;
+      if(window < 1)
+        window = 1;
+      uart_write_str(UART1, "W");
+      uart_write(UART1, window);
+      load_firmware(window, 0);
+    } else if (instruction == RESUME){
+      // Same as WINDOW, but the header is acknowledged with the frame to resume from
+      uint8_t window = uart_rx_read_byte();
+      if(window > WINDOW_MAX)
+        window = WINDOW_MAX;
+      if(window < 1)
+        window = 1;
+      uart_write_str(UART1, "J");
+      uart_write(UART1, window);
+      load_firmware(window, 1);
+    } else if (instruction == BAUD){
+      uart_write_str(UART1, "R");
+      negotiate_baud();
     } else if (instruction == BOOT){
       uart_write_str(UART1, "B");
       boot_firmware();
+#ifdef PROFILE
+    } else if (instruction == PROFILE_DUMP){
+      uart_write_str(UART1, "P");
+      profile_dump();
+#endif
     }
   }
 }
@@ -183,55 +331,164 @@ void send_err(void){
 }
 
 /*
- * Check for read error
+ * Acknowledges a verified frame.
+    With a window of 1 this is the plain OK the stop-and-wait host expects.
+    Otherwise the index of the frame follows, so the host can slide its window.
+    Frames are only accepted in order, so the ack is cumulative.
  */
-int check_read(int read){
-  if(!(read)) 
-    send_err();
-  return !(read);
+void send_frame_ack(uint16_t index, uint8_t window){
+  uart_write(UART1, OK);
+  if(window > 1){
+    uart_write(UART1, (uint8_t) index);
+    uart_write(UART1, (uint8_t) (index >> 8));
+  }
+  return;
+}
+
+/*
+ * Waits up to ms milliseconds for count bytes to be in the UART1 ring
+ */
+int wait_for_bytes(uint32_t count, uint32_t ms){
+  // SysCtlDelay() takes 3 cycles per loop
+  uint32_t ms_loops = SysCtlClockGet() / 3000;
+  
+  while(uart_rx_available() < count){
+    if(!ms--)
+      return 0;
+    SysCtlDelay(ms_loops);
+  }
+  return 1;
+}
+
+/*
+ * Reconfigures UART1 for a new baud rate
+ */
+void set_uart1_baud(uint32_t baud){
+  // Let whatever is still being sent at the old rate go out first
+  while(UARTBusy(UART1_BASE)){
+  }
+  UARTConfigSetExpClk(UART1_BASE, SysCtlClockGet(), baud,
+                      UART_CONFIG_WLEN_8 | UART_CONFIG_STOP_ONE | UART_CONFIG_PAR_NONE);
+  
+  // Anything received during the switch is garbage
+  uart_rx_flush();
+  uart1_baud = baud;
+  return;
+}
+
+/*
+ * Switches UART1 to a baud rate proposed by the host.
+    1. Reads the 4 byte little endian rate and checks the UART can make it.
+    2. Acknowledges at the old rate and switches.
+    3. The host sends the probe at the new rate and we echo it.
+    4. The host confirms it got the echo and we acknowledge at the new rate.
+ * If any step times out or does not match, the old rate is restored.
+ */
+void negotiate_baud(void){
+  uint8_t raw[4];
+  uint8_t probe[BAUD_PROBE_SIZE];
+  uint32_t old_baud = uart1_baud;
+  
+  uart_rx_read(raw, sizeof(raw));
+  uint32_t baud = (uint32_t) raw[0] | (uint32_t) raw[1] << 8 |
+                  (uint32_t) raw[2] << 16 | (uint32_t) raw[3] << 24;
+  
+  // The UART divides its clock by 16, nothing faster can be generated
+  if(baud == 0 || baud > SysCtlClockGet() / 16){
+    uart_write(UART1, ERROR);
+    return;
+  }
+  
+  uart_write(UART1, OK);
+  set_uart1_baud(baud);
+  
+  if(wait_for_bytes(BAUD_PROBE_SIZE, BAUD_TIMEOUT_MS)){
+    uart_rx_read(probe, BAUD_PROBE_SIZE);
+    
+    if(!memcmp(probe, baud_probe, BAUD_PROBE_SIZE)){
+      for(int i = 0; i < BAUD_PROBE_SIZE; i++)
+        uart_write(UART1, probe[i]);
+      
+      if(wait_for_bytes(1, BAUD_TIMEOUT_MS) && uart_rx_read_byte() == BAUD_CONFIRM){
+        uart_write(UART1, OK);
+        return;
+      }
+    }
+  }
+  
+  // The new rate did not work, go back to the one that did
+  set_uart1_baud(old_baud);
+  return;
 }
 
 /*
  * Reads in data with variable length from uart
+    Everything comes from the UART1 ring, which cannot fail a read.
  */ 
 void uart_read_variable(uint8_t uart, int blocking, char *da, int length){
-  int read;
   // It will never read in more than 1024 bytes a time
-  for(int i = 0; i < length && i < FLASH_PAGESIZE; i++){
-    da[i] = uart_read(UART1, BLOCKING, &read);
-    
-    // Check read status variable
-    if(check_read(read)) 
-      return;
-  }
+  if(length > FLASH_PAGESIZE)
+    length = FLASH_PAGESIZE;
+  uart_rx_read((uint8_t *) da, length);
+  return;
+}
+
+/*
+ * Sets up the AES-GCM context used for every frame of an update.
+    The GHASH key H = AES(0) comes precomputed from secrets.h, and so does the
+    aes_ct key schedule. This is what aes_ctr_init() and br_gcm_init() would set.
+ */
+void gcm_init(void){
+#ifdef AES_BACKEND_CT
+  aes_ctx.vtable = &br_aes_ct_ctr_vtable;
+  memcpy(aes_ctx.skey, aes_ct_skey, sizeof(aes_ct_skey));
+  aes_ctx.num_rounds = AES_NUM_ROUNDS;
+#else
+  aes_ctr_init(&aes_ctx, aes_key, AESKEY_SIZE);
+#endif
+  
+  gcm_ctx.vtable = &br_gcm_vtable;
+  gcm_ctx.bctx = &aes_ctx.vtable;
+  gcm_ctx.gh = ghash_backend;
+  memcpy(gcm_ctx.h, gcm_h, sizeof(gcm_ctx.h));
   return;
 }
 
 /*
- * Decrypts and verifies data using AES-GCM
-    This is used only once at the end to decrypt all
-    firmware.
+ * Builds the nonce of one frame (STREAM construction).
+    nonce = 7 byte prefix from the header || 4 byte big endian index || last flag
+    A frame therefore only decrypts in its own slot, and a stream that is cut
+    short never sees a frame with the last flag set.
  */
-int gcm_decrypt_and_verify(char* ct, int ct_len) {
-  char iv[IV_SIZE];
+void stream_nonce(char *nonce, const char *prefix, uint16_t index, int last){
+  memcpy(nonce, prefix, NONCE_PREFIX_SIZE);
+  nonce[NONCE_PREFIX_SIZE + 0] = 0;
+  nonce[NONCE_PREFIX_SIZE + 1] = 0;
+  nonce[NONCE_PREFIX_SIZE + 2] = (char) (index >> 8);
+  nonce[NONCE_PREFIX_SIZE + 3] = (char) index;
+  nonce[NONCE_PREFIX_SIZE + 4] = last ? 1 : 0;
+  return;
+}
+
+/*
+ * Decrypts and verifies one frame in place using AES-GCM
+    Every frame is its own GCM message, with the frame metadata
+    as associated data. Like sha_hmac(), it reads its own tag from UART.
+ */
+int gcm_decrypt_and_verify(char* ct, int ct_len, const char* nonce, const char* aad, int aad_len) {
   char tag[TAG_SIZE];
   
-  // Reads in IV nonce and tag
-  uart_read_variable(UART2, BLOCKING, iv, IV_SIZE);
+  // Reads in tag
   uart_read_variable(UART2, BLOCKING, tag, TAG_SIZE);
   
   // Code from beaverssl.h that decrypts AES-GCM
-  br_aes_ct_ctr_keys bc;
-  br_gcm_context gc;
-  br_aes_ct_ctr_init(&bc, aes_key, AESKEY_SIZE);
-  br_gcm_init(&gc, &bc.vtable, br_ghash_ctmul32);
-
-  br_gcm_reset(&gc, iv, IV_SIZE);         
-  br_gcm_flip(&gc);                        
-  br_gcm_run(&gc, 0, ct, ct_len);
+  br_gcm_reset(&gcm_ctx, nonce, NONCE_SIZE);
+  br_gcm_aad_inject(&gcm_ctx, aad, aad_len);
+  br_gcm_flip(&gcm_ctx);
+  br_gcm_run(&gcm_ctx, 0, ct, ct_len);
   
   // Verifies the data
-  if (!br_gcm_check_tag(&gc, tag)) {
+  if (!br_gcm_check_tag(&gcm_ctx, tag)) {
     send_err();
     return 0;
   }
@@ -240,26 +497,27 @@ int gcm_decrypt_and_verify(char* ct, int ct_len) {
 }
 
 /*
- * Verifies HMAC-SHA256.
-    This is used many times when recieving the firmware.
-    It is much simpler than the beaverssl function, since
-    it is mostly self-contained. Keys and lengths are
-    assumed and it reads its own HMAC from UART.
+ * Starts an HMAC-SHA256 for data that is not in one piece.
+    The key's inner and outer states come precomputed from secrets.h,
+    so no key blocks are hashed here.
  */
-int sha_hmac(char* data, int len) {
+void hmac_start(br_hmac_context *ctx){
+  br_hmac_init(ctx, &hmac_key_ctx, 0);
+  return;
+}
+
+/*
+ * Finishes an HMAC-SHA256 from hmac_start() and verifies it.
+    Like sha_hmac(), it reads the expected HMAC from UART.
+ */
+int hmac_check(br_hmac_context *ctx){
   char out[HMAC_SIZE];
   char hmac[HMAC_SIZE];
   
   // Reads in HMAC hash from
   uart_read_variable(UART2, BLOCKING, hmac, HMAC_SIZE);
   
-  // Copied from beaverssl.h to generate HMAC for data
-  br_hmac_key_context kc;
-  br_hmac_context ctx;
-  br_hmac_key_init(&kc, &br_sha256_vtable, hmac_key, HMAC_SIZE);
-  br_hmac_init(&ctx, &kc, 0);
-  br_hmac_update(&ctx, data, len);
-  br_hmac_out(&ctx, out);
+  br_hmac_out(ctx, out);
   
   // Compares the input and generated HMACs in constant time
   // Defends against timing attacks
@@ -276,49 +534,422 @@ int sha_hmac(char* data, int len) {
   return 32;
 }
 
+/*
+ * Verifies HMAC-SHA256.
+    This is used many times when recieving the firmware.
+    It is much simpler than the beaverssl function, since
+    it is mostly self-contained. Keys and lengths are
+    assumed and it reads its own HMAC from UART.
+ */
+int sha_hmac(char* data, int len) {
+  // Copied from beaverssl.h to generate HMAC for data
+  br_hmac_context ctx;
+  hmac_start(&ctx);
+  br_hmac_update(&ctx, data, len);
+  return hmac_check(&ctx);
+}
+
+/*
+ * Marks the installed firmware as incomplete before its first page is overwritten.
+    The old version is kept so rollback protection survives a failed update,
+    but with a size of zero boot_firmware() refuses to run what is left.
+ */
+void mark_install_started(void){
+  unsigned char metadata[FW_METADATA_SIZE] = {*((uint8_t *) METADATA_BASE),
+                                              *((uint8_t *) METADATA_BASE + 1),
+                                              0, 0, 0, 0};
+  program_flash(METADATA_BASE, metadata, FW_METADATA_SIZE);
+  journal_start();
+  return;
+}
+
+/*
+ * Checks whether header belongs to the update the journal was left by.
+    Only an install that never finished can be resumed, and only into pages
+    that were in flash before the journal said so.
+    Returns the number of pages that are in flash, 0 if nothing can be resumed.
+ */
+uint16_t journal_resume_point(const char *header){
+  uint16_t installed_size = (*((uint8_t*) METADATA_BASE+3) << 8) | *((uint8_t*)(METADATA_BASE+2));
+  if(installed_size != 0 || *((uint32_t *) (JOURNAL_BASE + JOURNAL_MAGIC_OFFSET)) != JOURNAL_MAGIC)
+    return 0;
+  
+  if(memcmp((char *) JOURNAL_BASE, header, FW_HEADER_SIZE))
+    return 0;
+  
+  // Count the committed pages up to the first word that is still erased
+  uint16_t pages = 0;
+  uint32_t *done = (uint32_t *) (JOURNAL_BASE + JOURNAL_PAGES_OFFSET);
+  while(pages < FW_MAX_SIZE / FLASH_PAGESIZE && done[pages] != 0xFFFFFFFF)
+    pages++;
+  return pages;
+}
+
+/*
+ * Starts a new journal for the update in journal_id.
+    An update that is not journaled still clears the old journal, since it is
+    about to overwrite the pages that journal vouches for.
+ */
+void journal_start(void){
+  unsigned char record[JOURNAL_PAGES_OFFSET];
+  uint32_t magic = JOURNAL_MAGIC;
+  
+  journal_pages = 0;
+  if(!journal_on){
+    flash_pipe_wait();
+    FlashErase(JOURNAL_BASE);
+    return;
+  }
+  
+  memset(record, 0xFF, sizeof(record));
+  memcpy(record, journal_id, FW_HEADER_SIZE);
+  memcpy(record + JOURNAL_MAGIC_OFFSET, &magic, sizeof(magic));
+  program_flash(JOURNAL_BASE, record, sizeof(record));
+  return;
+}
+
+/*
+ * Records that page pg of the new image is in flash.
+    The page must have finished programming, and pages are recorded in order.
+ */
+void journal_page_done(uint32_t pg){
+  uint32_t done = JOURNAL_PAGE_DONE;
+  
+  if(!journal_on || pg != journal_pages)
+    return;
+  
+  FlashProgram((unsigned long *) &done, JOURNAL_BASE + JOURNAL_PAGES_OFFSET + pg * FLASH_WRITESIZE, FLASH_WRITESIZE);
+  journal_pages++;
+  return;
+}
+
+/*
+ * Starts putting together a new image of size bytes.
+    ahead allows erasing the next page before it is filled, which
+    a patch cannot have since it still reads the old one.
+ */
+void stage_init(uint32_t size, int ahead){
+  out_len = 0;
+  out_size = size;
+  erase_ahead = ahead;
+  install_started = 0;
+  skip_pages = 0;
+  hmac_start(&image_mac);
+  return;
+}
+
+/*
+ * Hands a finished page of the new image to the flash pipeline
+ */
+int stage_commit(uint32_t pg){
+  uint32_t next_page = FLASH_PIPE_NO_PAGE;
+  uint32_t next = pg + 1;
+  
+  PROF_START(PROF_IMAGE_MAC);
+  br_hmac_update(&image_mac, page_buf[pg & 1], out_len - FLASH_PAGESIZE * pg);
+  PROF_PAUSE(PROF_IMAGE_MAC);
+  
+  // Pages that stay as they are must not be erased
+  while(next * FLASH_PAGESIZE < out_size && !page_needed(next))
+    next++;
+  if(erase_ahead && next * FLASH_PAGESIZE < out_size)
+    next_page = FW_BASE + FLASH_PAGESIZE * next;
+  
+  // The old firmware stops being bootable with the first page that is replaced
+  if(!install_started){
+    install_started = 1;
+    mark_install_started();
+  }
+  
+  // The previous page is only journaled once it is really in flash
+  if(journal_on && pg > 0){
+    if(flash_pipe_wait())
+      return 1;
+    journal_page_done(pg - 1);
+  }
+  
+  return flash_pipe_commit(FW_BASE + FLASH_PAGESIZE * pg, page_buf[pg & 1],
+                           out_len - FLASH_PAGESIZE * pg, next_page);
+}
+
+/*
+ * Adds bytes to the new image, committing every page that fills up.
+    Returns nonzero if the image would grow past its size or a page failed.
+ */
+int stage_write(const unsigned char *d, uint32_t n){
+  while(n){
+    uint32_t pg = out_len / FLASH_PAGESIZE;
+    uint32_t offset = out_len % FLASH_PAGESIZE;
+    uint32_t run = FLASH_PAGESIZE - offset;
+    if(run > n)
+      run = n;
+    if(out_len + run > out_size)
+      return 1;
+    
+    memcpy(page_buf[pg & 1] + offset, d, run);
+    out_len += run;
+    d += run;
+    n -= run;
+    
+    if(offset + run == FLASH_PAGESIZE || out_len == out_size){
+      if(stage_commit(pg))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Copies len bytes of the installed image at src into the new image.
+    Pages are replaced in order, so the copy may only read pages from the one
+    being built onwards: those have not been overwritten yet.
+ */
+int patch_copy(uint32_t src, uint32_t len){
+  if(src + len > base_size)
+    return 1;
+  
+  while(len){
+    uint32_t page_start = out_len - out_len % FLASH_PAGESIZE;
+    uint32_t run = FLASH_PAGESIZE - out_len % FLASH_PAGESIZE;
+    if(run > len)
+      run = len;
+    if(src < page_start)
+      return 1;
+    
+    if(stage_write((unsigned char *) FW_BASE + src, run))
+      return 1;
+    src += run;
+    len -= run;
+  }
+  return 0;
+}
+
+/*
+ * Applies decrypted patch bytes to the new image.
+    A patch is a list of ops:
+      PATCH_COPY | 2b offset | 2b length   (copy from the installed image)
+      PATCH_ADD  | 2b length | new bytes   (bytes that are not in it)
+    Returns nonzero on a malformed op or one that reads an overwritten page.
+ */
+int patch_feed(const unsigned char *d, uint32_t n){
+  while(n){
+    // Inside the new bytes of a PATCH_ADD
+    if(patch_left){
+      uint32_t run = patch_left < n ? patch_left : n;
+      if(stage_write(d, run))
+        return 1;
+      patch_left -= run;
+      d += run;
+      n -= run;
+      continue;
+    }
+    
+    // Start of the next op
+    if(patch_op == PATCH_NONE){
+      patch_op = *d++;
+      n--;
+      patch_have = 0;
+      if(patch_op != PATCH_COPY && patch_op != PATCH_ADD)
+        return 1;
+      continue;
+    }
+    
+    patch_args[patch_have++] = *d++;
+    n--;
+    
+    if(patch_op == PATCH_COPY && patch_have == 4){
+      patch_op = PATCH_NONE;
+      if(patch_copy((uint32_t) patch_args[0] | (uint32_t) patch_args[1] << 8,
+                    (uint32_t) patch_args[2] | (uint32_t) patch_args[3] << 8))
+        return 1;
+    } else if(patch_op == PATCH_ADD && patch_have == 2){
+      patch_op = PATCH_NONE;
+      patch_left = (uint32_t) patch_args[0] | (uint32_t) patch_args[1] << 8;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Decompresses LZSS bytes into the new image.
+    Every flag byte describes the next 8 items, LSB first:
+      1: a literal byte
+      0: a 2 byte little endian match token, 10 bits offset - 1, 6 bits length - 3
+    A match reaches back at most one page, so it is always in the page being
+    built or the one before it, and both are still in page_buf.
+    Returns nonzero on a match before the start of the image.
+ */
+int lz_feed(const unsigned char *d, uint32_t n){
+  while(n){
+    if(!lz_items){
+      lz_flags = *d++;
+      n--;
+      lz_items = 8;
+      continue;
+    }
+    
+    if(lz_flags & 1){
+      if(stage_write(d, 1))
+        return 1;
+      d++;
+      n--;
+      lz_flags >>= 1;
+      lz_items--;
+      continue;
+    }
+    
+    if(!lz_have_low){
+      lz_low = *d++;
+      n--;
+      lz_have_low = 1;
+      continue;
+    }
+    
+    uint32_t token = (uint32_t) lz_low | (uint32_t) *d++ << 8;
+    n--;
+    lz_have_low = 0;
+    lz_flags >>= 1;
+    lz_items--;
+    
+    uint32_t offset = (token & (LZ_WINDOW - 1)) + 1;
+    uint32_t len = (token >> LZ_OFFSET_BITS) + LZ_MIN_MATCH;
+    if(offset > out_len)
+      return 1;
+    
+    // Byte by byte, a match may overlap what it produces
+    while(len--){
+      uint32_t from = out_len - offset;
+      unsigned char byte = page_buf[(from / FLASH_PAGESIZE) & 1][from % FLASH_PAGESIZE];
+      if(stage_write(&byte, 1))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Whether page pg of the new image is sent, or already in flash
+ */
+int page_needed(uint32_t pg){
+  if(!skip_pages)
+    return 1;
+  return (pages_needed[pg / 8] >> (pg % 8)) & 1;
+}
+
+/*
+ * Reads the page manifest and works out which pages have to be sent.
+    The manifest is the HMAC of every page of the new image, followed by its own HMAC.
+    Each one is compared against the HMAC of what that page of flash holds
+    now, and the host is answered with a bitmap of the pages that differ.
+    The nonce prefix and page index are hashed in front of each page, so equal
+    pages do not get equal entries, within an update or across updates.
+    Returns 0 if the manifest does not verify.
+ */
+int page_manifest(uint16_t size, const char *nonce_prefix){
+  uint32_t pages = (size + FLASH_PAGESIZE - 1) / FLASH_PAGESIZE;
+  br_hmac_context ctx;
+  char digest[HMAC_SIZE];
+  
+  // Fits in the frame buffer, 30 pages of 32 bytes
+  uart_read_variable(UART1, BLOCKING, (char *) frame, pages * HMAC_SIZE);
+  if(!sha_hmac((char *) frame, pages * HMAC_SIZE))
+    return 0;
+  
+  memset(pages_needed, 0, PAGE_BITMAP_SIZE);
+  for(uint32_t pg = 0; pg < pages; pg++){
+    uint32_t len = size - pg * FLASH_PAGESIZE;
+    if(len > FLASH_PAGESIZE)
+      len = FLASH_PAGESIZE;
+    
+    unsigned char index[2] = {pg & 0xFF, pg >> 8};
+    hmac_start(&ctx);
+    br_hmac_update(&ctx, nonce_prefix, NONCE_PREFIX_SIZE);
+    br_hmac_update(&ctx, index, sizeof(index));
+    br_hmac_update(&ctx, (char *) FW_BASE + pg * FLASH_PAGESIZE, len);
+    br_hmac_out(&ctx, digest);
+    
+    int diff = 0;
+    for(int i = 0; i < HMAC_SIZE; i++)
+      diff |= digest[i] ^ frame[pg * HMAC_SIZE + i];
+    if(diff)
+      pages_needed[pg / 8] |= 1 << (pg % 8);
+  }
+  skip_pages = 1;
+  
+  uart_write(UART1, OK);
+  for(uint32_t i = 0; i < (pages + 7) / 8; i++)
+    uart_write(UART1, pages_needed[i]);
+  return 1;
+}
+
 /*
  * Load the firmware into flash.
  * Assume that verification is done with HMAC-SHA256.
  * Here is an overview of what happens in load_firmware():
-    1. Reads and verifies firmware metadata.
+    1. Reads and verifies the header (firmware metadata, nonce prefix and payload encoding).
+      * With ENC_PAGES, a page manifest follows and only the pages that differ are sent
     2. Reads and verifies frame metadata with.
     3. Reads in frame (<=1024 bytes) and verifies.
       * This HMAC is generated from the frame and metadata combined
-    4. Verifies entire firmware
-    5. Reads and verifies release message.
-    6. Verifies firmware, firmware metadata and release mesage together
-    7. Decrypts firmware with 128 bit AES-GCM
-    8. Flashes firmware
-    9. Flashes metadata and release message
+    4. Decrypts the frame with 128 bit AES-GCM and flashes the pages it completes
+      * A raw payload is the image, a delta payload is a patch that is
+        applied against the installed image and an LZ payload is decompressed
+    5. Verifies entire firmware
+    6. Reads and verifies release message.
+    7. Verifies firmware, firmware metadata and release mesage together
+      * Both HMACs absorb the image a page at a time as it is committed,
+        so neither needs another pass over it once the frames are in
+    8. Flashes metadata and release message
+ * Frames are streamed: each one is authenticated, decrypted and committed
+    through page sized buffers as it arrives, so RAM use does not depend
+    on the size of the image. Two page buffers take turns, the page in one is
+    erased and programmed in the background while the next frame fills
+    the other, and the page after it is erased ahead of time.
+ * window is the number of frames the host was granted to have in flight.
+    Frames keep arriving while earlier ones are verified, index_check
+    still rejects any gap or reordering.
+ * A raw update keeps a journal of the pages that are in flash. With resume
+    set, the header is acknowledged with the index of the first frame that
+    is still needed, which skips the pages an interrupted run of the same
+    update already committed. Those pages are hashed from flash instead.
  */
-void load_firmware(void){
+void load_firmware(uint8_t window, int resume){
+  PROF_CLEAR();
+  PROF_START(PROF_HANDSHAKE);
+  
   // Prints logo
   print_bolt();
     
   // General variables
-  int read;
   uint32_t bytes_recieved = 0;
-  uint32_t page_addr = FW_BASE;
   
   // Firmware variables
   uint16_t size = 0,
     r_msg_size,
-    version = 0;
-  char metadata[FW_METADATA_SIZE];
+    version = 0,
+    payload_size,
+    base_version;
+  uint8_t encoding;
+  char header[FW_HEADER_SIZE];
+  char *metadata = header;
+  char *nonce_prefix = header + FW_METADATA_SIZE;
+  char *xfer_info = nonce_prefix + NONCE_PREFIX_SIZE;
+  char nonce[NONCE_SIZE];
   
   //Frame variables
   uint16_t index,
     index_check = 0,
+    resume_from = 0,
     frame_version, 
     frame_length, 
     frame_number;
   char fr_metadata[FR_METADATA_SIZE];
   
-  //Reads metadata
-  uart_read_variable(UART1, BLOCKING, (char *) metadata, FW_METADATA_SIZE);
+  //Reads header
+  uart_read_variable(UART1, BLOCKING, header, FW_HEADER_SIZE);
   
-  //Verifies metadata
-  if(!sha_hmac((char *) metadata, FW_METADATA_SIZE))
+  //Verifies header
+  if(!sha_hmac(header, FW_HEADER_SIZE))
     return;
   
   // Extract firmware metadata
@@ -328,8 +959,15 @@ void load_firmware(void){
   
   r_msg_size = (uint16_t) metadata[4] | (uint16_t) metadata[5] << 8;
   
+  // Extract how the image is sent
+  encoding = (uint8_t) xfer_info[0];
+  
+  payload_size = (uint16_t) xfer_info[1] | (uint16_t) xfer_info[2] << 8;
+  
+  base_version = (uint16_t) xfer_info[3] | (uint16_t) xfer_info[4] << 8;
+  
   // Get number of frames, subtracts one because it is zero indexed.
-  frame_number = ceil((float) size / FLASH_PAGESIZE) - 1;
+  frame_number = ceil((float) payload_size / FLASH_PAGESIZE) - 1;
 
   // Compare to old version and abort if older (note special case for version 0).
   // Using the version address didn't always work, so it is read relative to METADATA_BASE.
@@ -341,7 +979,7 @@ void load_firmware(void){
     return;
   } 
   
-  if(size > FW_MAX_SIZE){
+  if(size == 0 || size > FW_MAX_SIZE){
     send_err();
     return;
   }
@@ -350,17 +988,112 @@ void load_firmware(void){
     send_err();
     return;
   }
+  
+  // A patch or compressed image is only ever sent when it is smaller than the image
+  if(payload_size == 0 || payload_size > FW_MAX_SIZE){
+    send_err();
+    return;
+  }
+  
+  if(encoding == ENC_RAW){
+    if(payload_size != size){
+      send_err();
+      return;
+    }
+    stage_init(size, 1);
+    
+    // Pick up where an interrupted run of this same update stopped
+    if(resume)
+      resume_from = journal_resume_point(header);
+    if(resume_from > frame_number + 1)
+      resume_from = 0;
+    index_check = resume_from;
+    bytes_recieved = resume_from * FLASH_PAGESIZE;
+    // The last page is journaled too, and it can be short
+    if(bytes_recieved > payload_size)
+      bytes_recieved = payload_size;
+    out_len = bytes_recieved;
+    journal_pages = resume_from;
+    install_started = resume_from > 0;
+    PROF_START(PROF_IMAGE_MAC);
+    br_hmac_update(&image_mac, (char *) FW_BASE, out_len);
+    PROF_PAUSE(PROF_IMAGE_MAC);
+  } else if(encoding == ENC_PAGES){
+    // The pages to send are only known once the manifest is in
+    if(payload_size != size){
+      send_err();
+      return;
+    }
+    stage_init(size, 1);
+  } else if(encoding == ENC_DELTA){
+    // A patch only applies to the exact image it was made against
+    base_size = (*((uint8_t*) METADATA_BASE+3) << 8) | *((uint8_t*)(METADATA_BASE+2));
+    if(base_version != old_version || base_size == 0){
+      send_err();
+      return;
+    }
+    patch_op = PATCH_NONE;
+    patch_left = 0;
+    stage_init(size, 0);
+  } else if(encoding == ENC_LZ){
+    // size is what it decompresses to, that is what gets flashed and checked
+    lz_items = 0;
+    lz_have_low = 0;
+    stage_init(size, 1);
+  } else {
+    send_err();
+    return;
+  }
 
+  journal_on = encoding == ENC_RAW;
+  journal_id = header;
+  
+  gcm_init();
+  
   uart_write(UART1, OK); // Acknowledge the metadata.
+  if(resume){
+    uart_write(UART1, (uint8_t) resume_from);
+    uart_write(UART1, (uint8_t) (resume_from >> 8));
+  }
+  
+  // Unchanged pages are left alone, so an interrupted run of this needs no journal
+  if(encoding == ENC_PAGES && !page_manifest(size, nonce_prefix))
+    return;
+  
+  PROF_STOP(PROF_HANDSHAKE);
   
   //Reads in frames
-  while (1) {
+  while (index_check <= frame_number) {
+    // Pages that are already in flash are not sent
+    if(!page_needed(index_check)){
+      // Buffers go by page parity, so the next page sent may reuse the buffer
+      // the page before this one is still being programmed from
+      if(flash_pipe_wait()){
+        send_err();
+        return;
+      }
+      uint32_t skipped = size - index_check * FLASH_PAGESIZE;
+      if(skipped > FLASH_PAGESIZE)
+        skipped = FLASH_PAGESIZE;
+      PROF_START(PROF_IMAGE_MAC);
+      br_hmac_update(&image_mac, (char *) FW_BASE + out_len, skipped);
+      PROF_PAUSE(PROF_IMAGE_MAC);
+      bytes_recieved += skipped;
+      out_len += skipped;
+      index_check += 1;
+      continue;
+    }
+    
     // Reads fr_metadata
+    PROF_START(PROF_FRAME_RX);
     uart_read_variable(UART2, BLOCKING, (char *) fr_metadata, FR_METADATA_SIZE);
+    PROF_PAUSE(PROF_FRAME_RX);
     
     // Verify fr_metadata
+    PROF_START(PROF_FRAME_HMAC);
     if(!sha_hmac((char*)fr_metadata, FR_METADATA_SIZE))
       return;
+    PROF_PAUSE(PROF_FRAME_HMAC);
     
     // Extract frame metadata.
     index = (uint16_t) fr_metadata[0] | (uint16_t) fr_metadata[1] << 8;
@@ -381,56 +1114,84 @@ void load_firmware(void){
       return;
     }
     
+    // Every frame but the last is full, so the frame count follows from the payload size
+    if(frame_length == 0 || (index != frame_number && frame_length != FLASH_PAGESIZE)){
+      send_err();
+      return;
+    }
+    
     // Check if versions match
     if(version != frame_version || frame_version == 1){
       send_err();
       return;
     }
     
-    // Read in frame
-    int i;
-    for(i = 0; i < frame_length && i < FLASH_PAGESIZE; i++){
-      data[FLASH_PAGESIZE * index + i] = uart_read(UART1, BLOCKING, &read);
-      
-      // Count the total bytes of firmware recieved
-      bytes_recieved++;
-      
-      // Data checks
-      if(check_read(read))
-        return;
-      if(bytes_recieved > size){
-        send_err();
-        return;
-      }
+    // Count the total bytes of payload recieved
+    bytes_recieved += frame_length;
+    if(bytes_recieved > payload_size){
+      send_err();
+      return;
     }
     
+    // Read in frame
+    PROF_START(PROF_FRAME_RX);
+    uart_rx_read(frame, frame_length);
+    PROF_STOP(PROF_FRAME_RX);
+    
     // Adds metadata to the end of frame
     for(int j = 0; j < FR_METADATA_SIZE; j++)
-      data[FLASH_PAGESIZE * index + i + j] = fr_metadata[j];
+      frame[frame_length + j] = fr_metadata[j];
     
     // Verifies metadata and frame together
-    if(!sha_hmac((char *) data + FLASH_PAGESIZE * index, frame_length + FR_METADATA_SIZE)) 
+    PROF_START(PROF_FRAME_HMAC);
+    if(!sha_hmac((char *) frame, frame_length + FR_METADATA_SIZE)) 
+      return;
+    PROF_STOP(PROF_FRAME_HMAC);
+    
+    // Decrypts the frame in place
+    PROF_START(PROF_GCM);
+    stream_nonce(nonce, nonce_prefix, index, index == frame_number);
+    if(!gcm_decrypt_and_verify((char *) frame, frame_length, nonce, fr_metadata, FR_METADATA_SIZE))
       return;
+    PROF_STOP(PROF_GCM);
+    
+    // Adds it to the new image, full pages are flashed in the background
+    int failed;
+    if(encoding == ENC_DELTA)
+      failed = patch_feed(frame, frame_length);
+    else if(encoding == ENC_LZ)
+      failed = lz_feed(frame, frame_length);
+    else // ENC_RAW and ENC_PAGES
+      failed = stage_write(frame, frame_length);
+    if(failed){
+      send_err();
+      return;
+    }
     
     // Increments index counter to compare with frame metadata
     index_check += 1;
 
-    uart_write(UART1, OK); // Acknowledge the frame.
-    
-    // Breaks out when all frames are recieved
-    if(index == frame_number)
-      break;
+    send_frame_ack(index, window); // Acknowledge the frame.
+  }
+  
+  // Size checks, a patch or compressed image must also end on a whole op or token
+  if(payload_size != bytes_recieved || out_len != size || patch_op != PATCH_NONE || patch_left || lz_have_low){
+    send_err();
+    return;
   }
   
-  // Size check
-  if(size != bytes_recieved){
+  // Last page has to be in flash before it is read back
+  if(flash_pipe_wait()){
     send_err();
     return;
   }
+  journal_page_done(frame_number);
   
-  // Verify full firmware with HMAC
-  if(!sha_hmac((char *) data, size))
+  // Verify full firmware with HMAC, built as the pages were committed
+  PROF_START(PROF_IMAGE_MAC);
+  if(!hmac_check(&image_mac))
     return;
+  PROF_STOP(PROF_IMAGE_MAC);
   
   uart_write(UART1, OK); //Acknowledge firmware
   
@@ -443,46 +1204,16 @@ void load_firmware(void){
   
   uart_write(UART1, OK); //Acknowledge release message
   
-  // Adds firmware metadata and release message to the end of data
-  for(int i = 0; i < FW_METADATA_SIZE; i++)
-    data[size + i] = metadata[i];
-  for(int i = 0; i < r_msg_size && i < RELEASE_MAX_SIZE; i++)
-    data[size + FW_METADATA_SIZE + i] = fw_release_message[i];
-  
-  // Verify firmware, firmware metadata and release message
-  if(!sha_hmac((char *) data, size + FW_METADATA_SIZE + r_msg_size))
+  // Verify firmware, firmware metadata and release message, picking up after the image
+  PROF_START(PROF_BIG_MAC);
+  br_hmac_update(&image_mac, metadata, FW_METADATA_SIZE);
+  br_hmac_update(&image_mac, fw_release_message, r_msg_size);
+  if(!hmac_check(&image_mac))
     return;
-  
-  // Sets everything except firmware to zero in case of any issues flashing
-  for(int i = 0; i < FW_METADATA_SIZE + r_msg_size && i < FW_METADATA_SIZE + RELEASE_MAX_SIZE; i++)
-    data[size + i] = 0x00;
+  PROF_STOP(PROF_BIG_MAC);
   
   uart_write(UART1, OK); // Acknowledge the HMAC
   
-  // Decrypt firmware and verify
-  if(!gcm_decrypt_and_verify((char *) data, size))
-    return;
-  
-  uart_write(UART1, OK); // Decryption was successful
-  
-  // Flash firmware
-  for(int i = 0; i < size; i += FLASH_PAGESIZE){
-    
-    // Make sure it is flashing the correct amount of data
-    frame_length = size - i;
-    if(frame_length > FLASH_PAGESIZE)
-      frame_length = FLASH_PAGESIZE;
-    
-    // Flash page
-    if (program_flash(page_addr, data + i, frame_length)){
-      send_err();
-      return;
-    }
-    // Increments address by page size
-    page_addr += FLASH_PAGESIZE;
-    
-  }
-  
   // If in debug, it will set the metadata version back.
   if(version == 0){
     metadata[0] = *((uint8_t *) METADATA_BASE);
@@ -496,10 +1227,16 @@ void load_firmware(void){
   }
   
   // Flash release message
+  PROF_START(PROF_RELEASE_WRITE);
   if (program_flash(RELEASE_BASE, (unsigned char *) fw_release_message, r_msg_size)){
     send_err();
     return;
   }
+  PROF_STOP(PROF_RELEASE_WRITE);
+  
+  // Nothing left to resume
+  FlashErase(JOURNAL_BASE);
+  journal_on = 0;
 }
 
 /*
@@ -515,8 +1252,16 @@ long program_flash(uint32_t page_addr, unsigned char *data, unsigned int data_le
   int ret;
   int i;
 
+  // Let the background pipeline finish with the flash controller first
+  if (flash_pipe_wait()) {
+    return -1;
+  }
+
   // Erase next FLASH page
+  PROF_START(PROF_FLASH_ERASE);
   FlashErase(page_addr);
+  PROF_STOP(PROF_FLASH_ERASE);
+  PROF_START(PROF_FLASH_PROGRAM);
 
   // Clear potentially unused bytes in last word
   // If data not a multiple of 4 (word size), program up to the last word
@@ -529,6 +1274,7 @@ long program_flash(uint32_t page_addr, unsigned char *data, unsigned int data_le
     // Program up to the last word
     ret = FlashProgram((unsigned long *)data, page_addr, num_full_bytes);
     if (ret != 0) {
+      PROF_STOP(PROF_FLASH_PROGRAM);
       return ret;
     }
     
@@ -541,20 +1287,29 @@ long program_flash(uint32_t page_addr, unsigned char *data, unsigned int data_le
     }
     
     // Program word
-    return FlashProgram(&word, page_addr+num_full_bytes, 4);
+    ret = FlashProgram(&word, page_addr+num_full_bytes, 4);
   } else{
     // Write full buffer of 4-byte words
-    return FlashProgram((unsigned long *)data, page_addr, data_len);
+    ret = FlashProgram((unsigned long *)data, page_addr, data_len);
   }
+  PROF_STOP(PROF_FLASH_PROGRAM);
+  return ret;
 }
 
 /*
  * Boots with flashed firmware
  */
 void boot_firmware(void){
-  // Get release message size
+  // Get firmware and release message size
+  uint16_t fw_size = (*((uint8_t*) METADATA_BASE + 3) << 8) | *((uint8_t*)(METADATA_BASE + 2));
   uint16_t msg_size = (*((uint8_t*) METADATA_BASE + 5) << 8) | *((uint8_t*)(METADATA_BASE + 4));
   
+  // An interrupted update leaves no complete firmware behind
+  if(!fw_size){
+    send_err();
+    return;
+  }
+  
   // Write release message
   // Uses size from metadata to make sure it doesn't read past the message
   // Address of the release message never changes
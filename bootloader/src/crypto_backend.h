@@ -0,0 +1,68 @@
+#ifndef CRYPTO_BACKEND_H
+#define CRYPTO_BACKEND_H
+
+#include "bearssl.h"
+#include "aes_fast.h"
+#include "ghash_4bit.h"
+#include "sha256_fast.h"
+
+/*
+ * Implementations the bootloader decrypts and authenticates with, BearSSL's
+ * or our own. Picked at build time, make AES=ct|small|big|fast
+ * GHASH=ctmul|ctmul32|ctmul64|4bit SHA=fast|bearssl (see the Makefile), and
+ * measured against each other by bench.c.
+ */
+
+#if defined(AES_BACKEND_CT)
+// Constant time, its key schedule comes precomputed in secrets.h
+typedef br_aes_ct_ctr_keys aes_ctr_keys;
+#define aes_ctr_init br_aes_ct_ctr_init
+#define AES_BACKEND_NAME "aes_ct"
+#elif defined(AES_BACKEND_SMALL)
+// Table based, small tables
+typedef br_aes_small_ctr_keys aes_ctr_keys;
+#define aes_ctr_init br_aes_small_ctr_init
+#define AES_BACKEND_NAME "aes_small"
+#elif defined(AES_BACKEND_BIG)
+// Table based, big tables
+typedef br_aes_big_ctr_keys aes_ctr_keys;
+#define aes_ctr_init br_aes_big_ctr_init
+#define AES_BACKEND_NAME "aes_big"
+#elif defined(AES_BACKEND_FAST)
+// One T-table, AES-128 only, see aes_fast.c
+typedef aes_fast_ctr_keys aes_ctr_keys;
+#define aes_ctr_init aes_fast_ctr_init
+#define AES_BACKEND_NAME "aes_fast"
+#else
+#error "Unknown AES backend, build with AES=ct, AES=small, AES=big or AES=fast"
+#endif
+
+#if defined(GHASH_BACKEND_CTMUL)
+#define ghash_backend br_ghash_ctmul
+#define GHASH_BACKEND_NAME "ghash_ctmul"
+#elif defined(GHASH_BACKEND_CTMUL32)
+#define ghash_backend br_ghash_ctmul32
+#define GHASH_BACKEND_NAME "ghash_ctmul32"
+#elif defined(GHASH_BACKEND_CTMUL64)
+#define ghash_backend br_ghash_ctmul64
+#define GHASH_BACKEND_NAME "ghash_ctmul64"
+#elif defined(GHASH_BACKEND_4BIT)
+// Table keyed on the first call, see ghash_4bit.c
+#define ghash_backend ghash_4bit
+#define GHASH_BACKEND_NAME "ghash_4bit"
+#else
+#error "Unknown GHASH backend, build with GHASH=ctmul, GHASH=ctmul32, GHASH=ctmul64 or GHASH=4bit"
+#endif
+
+#if defined(SHA_BACKEND_FAST)
+// Unrolled for the M3, see sha256_fast.c
+#define sha256_backend sha256_fast_vtable
+#define SHA_BACKEND_NAME "sha256_fast"
+#elif defined(SHA_BACKEND_BEARSSL)
+#define sha256_backend br_sha256_vtable
+#define SHA_BACKEND_NAME "sha256_bearssl"
+#else
+#error "Unknown SHA-256 backend, build with SHA=fast or SHA=bearssl"
+#endif
+
+#endif //CRYPTO_BACKEND_H
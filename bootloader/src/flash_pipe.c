@@ -0,0 +1,215 @@
+// Hardware Imports
+#include "inc/hw_memmap.h" // Peripheral Base Addresses
+#include "inc/hw_types.h" // Boolean type, HWREG
+#include "inc/hw_ints.h" // Interrupt numbers
+#include "inc/hw_flash.h" // Flash controller registers
+
+// Driver API Imports
+#include "driverlib/flash.h" // FLASH API
+#include "driverlib/interrupt.h" // Interrupt API
+
+#include "flash_pipe.h"
+#include "profile.h" // Erase and program times, with make PROFILE=1
+
+/*
+ * Background flash programming.
+ * A page is handed over with flash_pipe_commit() and then erased and
+ * programmed one word at a time, each step started from the flash
+ * controller's completion interrupt. The caller goes back to receiving and
+ * verifying the next frame into its other buffer meanwhile (ping-pong), and
+ * the erase of the page after it is started as soon as this one is done.
+ * Only one page is ever in flight: commit waits for the previous one.
+ * The pipeline reads the buffer it was handed one word at a time, so the
+ * caller must not touch that buffer until the next commit or
+ * flash_pipe_wait() has returned. Alternating two buffers is only safe if
+ * they alternate per commit; a caller that skips a page must wait first.
+ *
+ * Every step is also advanced by polling in flash_pipe_wait(), so nothing
+ * depends on the interrupt actually arriving.
+ *
+ * Every word is read back once it is programmed, so what reaches flash is
+ * what the caller hashed from its buffer.
+ */
+
+#define FLASH_WRITESIZE 4
+
+// What the flash controller is doing for us
+#define PIPE_IDLE 0
+#define PIPE_ERASE 1 // Erasing the page that is being committed
+#define PIPE_PROGRAM 2 // Programming its words
+#define PIPE_ERASE_AHEAD 3 // Erasing the next page before its data is here
+
+static volatile int state = PIPE_IDLE;
+static volatile int error = 0;
+
+// Page being committed
+static uint32_t page;
+static const uint8_t *buf;
+static uint32_t len;
+static volatile uint32_t next_word;
+static uint32_t word_written; // Value of the word being programmed
+
+// Page to erase once the current one is programmed, and the one that already is
+static volatile uint32_t ahead = FLASH_PIPE_NO_PAGE;
+static volatile uint32_t erased = FLASH_PIPE_NO_PAGE;
+
+/*
+ * Starts an erase of one page without waiting for it
+ */
+static void start_erase(uint32_t page_addr){
+  PROF_START(PROF_FLASH_ERASE);
+  HWREG(FLASH_FMA) = page_addr;
+  HWREG(FLASH_FMC) = FLASH_FMC_WRKEY | FLASH_FMC_ERASE;
+}
+
+/*
+ * Starts programming the next word of the current page without waiting for it
+    A partial last word is filled with 0xFF, like program_flash() does.
+ */
+static void start_word(void){
+  uint32_t offset = next_word * FLASH_WRITESIZE;
+  uint32_t word = 0;
+  
+  for(int i = 0; i < FLASH_WRITESIZE; i++){
+    uint32_t byte = offset + i < len ? buf[offset + i] : 0xFF;
+    word |= byte << (8 * i);
+  }
+  
+  word_written = word;
+  HWREG(FLASH_FMA) = page + offset;
+  HWREG(FLASH_FMD) = word;
+  HWREG(FLASH_FMC) = FLASH_FMC_WRKEY | FLASH_FMC_WRITE;
+}
+
+/*
+ * Moves on after the flash controller finished an erase or a word
+ */
+static void advance(void){
+  // Finished an erase or program that was not ours (program_flash())
+  if(state == PIPE_IDLE)
+    return;
+  
+  // Writes to protected or invalid flash are reported as access errors
+  if(HWREG(FLASH_FCRIS) & FLASH_FCRIS_ARIS){
+    HWREG(FLASH_FCMISC) = FLASH_FCMISC_AMISC;
+    error = 1;
+  }
+  
+  switch(state){
+    case PIPE_ERASE:
+      PROF_STOP(PROF_FLASH_ERASE);
+      PROF_START(PROF_FLASH_PROGRAM);
+      next_word = 0;
+      state = PIPE_PROGRAM;
+      start_word();
+      break;
+      
+    case PIPE_PROGRAM:
+      if(HWREG(page + next_word * FLASH_WRITESIZE) != word_written)
+        error = 1;
+      next_word++;
+      if(next_word * FLASH_WRITESIZE < len){
+        start_word();
+      } else if(ahead != FLASH_PIPE_NO_PAGE){
+        PROF_STOP(PROF_FLASH_PROGRAM);
+        state = PIPE_ERASE_AHEAD;
+        start_erase(ahead);
+      } else {
+        PROF_STOP(PROF_FLASH_PROGRAM);
+        state = PIPE_IDLE;
+      }
+      break;
+      
+    case PIPE_ERASE_AHEAD:
+      PROF_STOP(PROF_FLASH_ERASE);
+      erased = ahead;
+      ahead = FLASH_PIPE_NO_PAGE;
+      state = PIPE_IDLE;
+      break;
+  }
+}
+
+/*
+ * Flash controller interrupt, one erase or word program finished
+ */
+void FLASH_IRQHandler(void){
+  // Left pending by a completion flash_pipe_wait() already handled
+  if(!(HWREG(FLASH_FCRIS) & FLASH_FCRIS_PRIS) || (HWREG(FLASH_FMC) & (FLASH_FMC_WRITE | FLASH_FMC_ERASE)))
+    return;
+  FlashIntClear(FLASH_INT_PROGRAM);
+  advance();
+}
+
+/*
+ * Enables the flash controller completion interrupt
+ */
+void flash_pipe_init(void){
+  state = PIPE_IDLE;
+  error = 0;
+  ahead = FLASH_PIPE_NO_PAGE;
+  erased = FLASH_PIPE_NO_PAGE;
+  
+  FlashIntClear(FLASH_INT_PROGRAM | FLASH_INT_ACCESS);
+  FlashIntEnable(FLASH_INT_PROGRAM);
+  IntEnable(INT_FLASH);
+}
+
+/*
+ * Whether a page is still being erased or programmed
+ */
+int flash_pipe_busy(void){
+  return state != PIPE_IDLE;
+}
+
+/*
+ * Waits for everything handed to the pipeline to be in flash.
+    Returns nonzero if any of it failed.
+ */
+int flash_pipe_wait(void){
+  while(state != PIPE_IDLE){
+    // Same work as the interrupt, with the interrupt held off
+    IntDisable(INT_FLASH);
+    if(state != PIPE_IDLE && !(HWREG(FLASH_FMC) & (FLASH_FMC_WRITE | FLASH_FMC_ERASE))){
+      FlashIntClear(FLASH_INT_PROGRAM);
+      advance();
+      // The interrupt for it is still latched in the NVIC
+      IntPendClear(INT_FLASH);
+    }
+    IntEnable(INT_FLASH);
+  }
+  
+  int failed = error;
+  error = 0;
+  return failed;
+}
+
+/*
+ * Hands one page over to be erased and programmed in the background.
+    data must stay untouched until the next commit or wait returns.
+    next_page_addr is erased right after, FLASH_PIPE_NO_PAGE if there is none.
+    Returns nonzero if the previous page failed.
+ */
+int flash_pipe_commit(uint32_t page_addr, const uint8_t *data, uint32_t data_len, uint32_t next_page_addr){
+  int failed = flash_pipe_wait();
+  
+  page = page_addr;
+  buf = data;
+  len = data_len;
+  next_word = 0;
+  ahead = next_page_addr;
+  
+  IntDisable(INT_FLASH);
+  if(erased == page_addr){
+    // Erased ahead of time, go straight to programming
+    erased = FLASH_PIPE_NO_PAGE;
+    state = PIPE_PROGRAM;
+    PROF_START(PROF_FLASH_PROGRAM);
+    start_word();
+  } else {
+    state = PIPE_ERASE;
+    start_erase(page_addr);
+  }
+  IntEnable(INT_FLASH);
+  
+  return failed;
+}
@@ -0,0 +1,13 @@
+#ifndef FLASH_PIPE_H
+#define FLASH_PIPE_H
+
+#include <stdint.h>
+
+#define FLASH_PIPE_NO_PAGE 0xFFFFFFFF
+
+void flash_pipe_init(void);
+int flash_pipe_commit(uint32_t page_addr, const uint8_t *data, uint32_t data_len, uint32_t next_page_addr);
+int flash_pipe_busy(void);
+int flash_pipe_wait(void);
+
+#endif //FLASH_PIPE_H
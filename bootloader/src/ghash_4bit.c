@@ -0,0 +1,133 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "ghash_4bit.h"
+
+/*
+ * GHASH with Shoup's 4-bit tables.
+ * The multiples 0..15 of H are computed once, after which every block is
+ * multiplied four bits at a time: 32 table lookups and a shift of the 128 bit
+ * accumulator per block, against the 32x32 carryless multiplies BearSSL's
+ * ctmul32 emulates in software. The table is 256 bytes of RAM.
+ *
+ * br_ghash has no room for a keyed state, so the table is built the first
+ * time an H is seen and kept until another one comes along. The bootloader
+ * only ever uses the H from secrets.h, so that happens once per boot.
+ * Lookups depend on H and the data, which is fine on the LM3S6965 since it
+ * has no data cache (see aes_fast.c).
+ */
+
+#define BLOCK_SIZE 16
+
+// Reduction of the four bits shifted out, already placed in the top half word
+static const uint16_t REDUCE[16] = {
+  0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+  0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0,
+};
+
+// i * H for every 4 bit i (bit reflected, as GCM orders them), big endian words
+static uint32_t table[16][4];
+static unsigned char table_h[BLOCK_SIZE];
+static int table_ready = 0;
+
+static inline uint32_t load_be32(const unsigned char *p){
+  uint32_t x;
+  memcpy(&x, p, sizeof(x));
+  return __builtin_bswap32(x);
+}
+
+static inline void store_be32(unsigned char *p, uint32_t x){
+  x = __builtin_bswap32(x);
+  memcpy(p, &x, sizeof(x));
+}
+
+/*
+ * Builds the table of multiples of h
+ */
+static void table_init(const unsigned char *h){
+  uint32_t v[4];
+  
+  for(int i = 0; i < 4; i++)
+    v[i] = load_be32(h + 4 * i);
+  
+  // H, H * x, H * x^2, H * x^3 sit at 8, 4, 2, 1
+  memset(table[0], 0, sizeof(table[0]));
+  memcpy(table[8], v, sizeof(v));
+  for(int i = 4; i > 0; i >>= 1){
+    uint32_t carry = (v[3] & 1) ? 0xe1000000 : 0;
+    v[3] = (v[3] >> 1) | (v[2] << 31);
+    v[2] = (v[2] >> 1) | (v[1] << 31);
+    v[1] = (v[1] >> 1) | (v[0] << 31);
+    v[0] = (v[0] >> 1) ^ carry;
+    memcpy(table[i], v, sizeof(v));
+  }
+  
+  // The rest are sums of those
+  for(int i = 2; i < 16; i <<= 1)
+    for(int j = 1; j < i; j++)
+      for(int k = 0; k < 4; k++)
+        table[i + j][k] = table[i][k] ^ table[j][k];
+  
+  memcpy(table_h, h, BLOCK_SIZE);
+  table_ready = 1;
+}
+
+/*
+ * Shifts z right by four bits, reduces, and adds in the multiple for nibble
+ */
+#define STEP(nibble) do { \
+    uint32_t rem = z3 & 0xf; \
+    z3 = (z3 >> 4) | (z2 << 28); \
+    z2 = (z2 >> 4) | (z1 << 28); \
+    z1 = (z1 >> 4) | (z0 << 28); \
+    z0 = (z0 >> 4) ^ ((uint32_t) REDUCE[rem] << 16); \
+    z0 ^= table[nibble][0]; z1 ^= table[nibble][1]; \
+    z2 ^= table[nibble][2]; z3 ^= table[nibble][3]; \
+  } while(0)
+
+/*
+ * y = (y + x) * H, one block
+ */
+static void mult_h(unsigned char *y, const unsigned char *x){
+  unsigned char b[BLOCK_SIZE];
+  uint32_t z0, z1, z2, z3;
+  
+  for(int i = 0; i < BLOCK_SIZE; i++)
+    b[i] = y[i] ^ x[i];
+  
+  // Last byte first, low nibble before high
+  z0 = table[b[15] & 0xf][0]; z1 = table[b[15] & 0xf][1];
+  z2 = table[b[15] & 0xf][2]; z3 = table[b[15] & 0xf][3];
+  STEP(b[15] >> 4);
+  for(int i = 14; i >= 0; i--){
+    STEP(b[i] & 0xf);
+    STEP(b[i] >> 4);
+  }
+  
+  store_be32(y, z0);
+  store_be32(y + 4, z1);
+  store_be32(y + 8, z2);
+  store_be32(y + 12, z3);
+}
+
+/*
+ * Processes len bytes of data into y, zero padding a partial last block
+    like every other br_ghash
+ */
+void ghash_4bit(void *y, const void *h, const void *data, size_t len){
+  const unsigned char *d = data;
+  
+  if(!table_ready || memcmp(table_h, h, BLOCK_SIZE))
+    table_init(h);
+  
+  while(len >= BLOCK_SIZE){
+    mult_h(y, d);
+    d += BLOCK_SIZE;
+    len -= BLOCK_SIZE;
+  }
+  if(len > 0){
+    unsigned char tmp[BLOCK_SIZE] = {0};
+    memcpy(tmp, d, len);
+    mult_h(y, tmp);
+  }
+}
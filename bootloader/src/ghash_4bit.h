@@ -0,0 +1,9 @@
+#ifndef GHASH_4BIT_H
+#define GHASH_4BIT_H
+
+#include <stddef.h>
+
+// Fits br_ghash, rebuilds its table whenever h changes
+void ghash_4bit(void *y, const void *h, const void *data, size_t len);
+
+#endif //GHASH_4BIT_H
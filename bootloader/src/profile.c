@@ -0,0 +1,118 @@
+// Hardware Imports
+#include "inc/hw_types.h" // Boolean type, HWREG
+
+// Driver API Imports
+#include "driverlib/sysctl.h" // System control API (clock/reset)
+
+// Application Imports
+#include "uart.h"
+
+#include "profile.h"
+
+/*
+ * Per-phase cycle counts of updates, from the Cortex-M3 DWT cycle counter.
+ * A phase is timed between profile_start() and profile_stop(); a phase that
+ * is interleaved with others (the HMACs of a frame around its receive) is
+ * paused in between, so its time is summed into one sample. Every sample
+ * goes into min/max/sum/count in a fixed table, which the 'P' command dumps
+ * over UART2 and then clears.
+ *
+ * Flash phases are timed from flash_pipe.c, partly in its interrupt.
+ * Only built with make PROFILE=1. QEMU does not model the cycle counter,
+ * so the numbers only mean something on a real board.
+ */
+
+// Debug and trace registers, not in the StellarisWare headers
+#define DEMCR 0xE000EDFC
+#define DEMCR_TRCENA 0x01000000 // Powers up the DWT
+#define DWT_CTRL 0xE0001000
+#define DWT_CTRL_CYCCNTENA 0x00000001
+#define DWT_CYCCNT 0xE0001004
+
+typedef struct {
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t sum;
+} profile_entry;
+
+static profile_entry table[PROF_PHASES];
+
+// Cycle count at the start of each running phase, and what it ran before a pause
+static uint32_t started[PROF_PHASES];
+static uint32_t running[PROF_PHASES];
+
+/*
+ * Starts the cycle counter and empties the table
+ */
+void profile_init(void){
+  HWREG(DEMCR) |= DEMCR_TRCENA;
+  HWREG(DWT_CYCCNT) = 0;
+  HWREG(DWT_CTRL) |= DWT_CTRL_CYCCNTENA;
+  
+  for(int i = 0; i < PROF_PHASES; i++){
+    table[i].count = 0;
+    table[i].min = 0xFFFFFFFF;
+    table[i].max = 0;
+    table[i].sum = 0;
+  }
+  profile_clear();
+}
+
+/*
+ * Drops the time of paused phases, an update that failed leaves some behind
+ */
+void profile_clear(void){
+  for(int i = 0; i < PROF_PHASES; i++)
+    running[i] = 0;
+}
+
+void profile_start(int phase){
+  started[phase] = HWREG(DWT_CYCCNT);
+}
+
+void profile_pause(int phase){
+  running[phase] += HWREG(DWT_CYCCNT) - started[phase];
+}
+
+/*
+ * Ends a phase and adds it, with whatever it ran before pauses, as one sample
+ */
+void profile_stop(int phase){
+  uint32_t cycles = running[phase] + (HWREG(DWT_CYCCNT) - started[phase]);
+  profile_entry *e = &table[phase];
+  
+  running[phase] = 0;
+  e->count++;
+  e->sum += cycles;
+  if(cycles < e->min)
+    e->min = cycles;
+  if(cycles > e->max)
+    e->max = cycles;
+}
+
+/*
+ * Writes a word little endian to UART2
+ */
+static void write_le32(uint32_t x){
+  for(int i = 0; i < 4; i++)
+    uart_write(UART2, (x >> (8 * i)) & 0xFF);
+}
+
+/*
+ * Sends the table over UART2 and starts a new one.
+    Phases that never ran have a count of zero and a min of 0xFFFFFFFF.
+ */
+void profile_dump(void){
+  uart_write_str(UART2, PROF_DUMP_MAGIC);
+  uart_write(UART2, PROF_PHASES);
+  write_le32(SysCtlClockGet());
+  for(int i = 0; i < PROF_PHASES; i++){
+    write_le32(table[i].count);
+    write_le32(table[i].min);
+    write_le32(table[i].max);
+    write_le32((uint32_t) table[i].sum);
+    write_le32((uint32_t) (table[i].sum >> 32));
+  }
+  profile_init();
+}
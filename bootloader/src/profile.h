@@ -0,0 +1,43 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+// Phases of an update that are timed, one sample each per frame, page or update
+#define PROF_HANDSHAKE 0 // Start of load_firmware() until the header (and manifest) is acknowledged
+#define PROF_FRAME_RX 1 // Frame metadata and frame received
+#define PROF_FRAME_HMAC 2 // HMACs of the frame metadata and of the frame
+#define PROF_GCM 3 // AES-GCM decryption and tag check of a frame
+#define PROF_IMAGE_MAC 4 // Whole-image HMAC, every page absorbed plus the check
+#define PROF_BIG_MAC 5 // Metadata and release message on top of the image HMAC, plus the check
+#define PROF_FLASH_ERASE 6 // One page erased
+#define PROF_FLASH_PROGRAM 7 // One page programmed
+#define PROF_RELEASE_WRITE 8 // Release message flashed
+#define PROF_PHASES 9
+
+// Dump format on UART2: magic, phase count, clock, then per phase count, min, max (LE32) and sum (LE64)
+#define PROF_DUMP_MAGIC "PROF"
+
+#ifdef PROFILE
+void profile_init(void);
+void profile_clear(void);
+void profile_start(int phase);
+void profile_pause(int phase);
+void profile_stop(int phase);
+void profile_dump(void);
+
+#define PROF_INIT() profile_init()
+#define PROF_CLEAR() profile_clear()
+#define PROF_START(phase) profile_start(phase)
+#define PROF_PAUSE(phase) profile_pause(phase)
+#define PROF_STOP(phase) profile_stop(phase)
+#else
+// Compiled out, not even the cycle counter is touched
+#define PROF_INIT() do {} while(0)
+#define PROF_CLEAR() do {} while(0)
+#define PROF_START(phase) do {} while(0)
+#define PROF_PAUSE(phase) do {} while(0)
+#define PROF_STOP(phase) do {} while(0)
+#endif
+
+#endif //PROFILE_H
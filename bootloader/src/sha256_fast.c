@@ -0,0 +1,197 @@
+#include <string.h>
+
+#include "sha256_fast.h"
+
+/*
+ * SHA-256 tuned for the Cortex-M3.
+ * BearSSL's compression function loops over a 64 word schedule and shuffles
+ * the eight working variables every round. Here the rounds are unrolled
+ * sixteen at a time, the variables rotate by name instead of being moved, and
+ * the schedule is a 16 word ring updated in place, so the compiler can keep
+ * the working set in registers. Every sigma is three rotates, which the M3
+ * does for free on the second operand of an EOR, and block words are loaded
+ * with an unaligned LDR and REV.
+ *
+ * The state is encoded like BearSSL's (big endian words), so the HMAC key
+ * states precomputed for br_sha256_vtable work with this one unchanged.
+ */
+
+#define BLOCK_SIZE 64
+
+static const uint32_t K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t IV[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(e, f, g) ((((f) ^ (g)) & (e)) ^ (g))
+#define MAJ(a, b, c) (((a) & (b)) | (((a) | (b)) & (c)))
+#define BSIG0(a) (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22))
+#define BSIG1(e) (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25))
+#define SSIG0(x) (ROR(x, 7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define SSIG1(x) (ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+
+// Word j of the first 16 rounds, and of the later ones (computed in place)
+#define W_LOAD(j) (w[j])
+#define W_NEXT(j) (w[j] += SSIG1(w[((j) + 14) & 15]) + w[((j) + 9) & 15] + SSIG0(w[((j) + 1) & 15]))
+
+// One round, the caller rotates the names so nothing is moved
+#define ROUND(a, b, c, d, e, f, g, h, i, j, WORD) do { \
+    uint32_t t1 = h + BSIG1(e) + CH(e, f, g) + K[(i) + (j)] + WORD(j); \
+    d += t1; \
+    h = t1 + BSIG0(a) + MAJ(a, b, c); \
+  } while(0)
+
+#define ROUNDS16(i, WORD) do { \
+    ROUND(a, b, c, d, e, f, g, h, i, 0, WORD); \
+    ROUND(h, a, b, c, d, e, f, g, i, 1, WORD); \
+    ROUND(g, h, a, b, c, d, e, f, i, 2, WORD); \
+    ROUND(f, g, h, a, b, c, d, e, i, 3, WORD); \
+    ROUND(e, f, g, h, a, b, c, d, i, 4, WORD); \
+    ROUND(d, e, f, g, h, a, b, c, i, 5, WORD); \
+    ROUND(c, d, e, f, g, h, a, b, i, 6, WORD); \
+    ROUND(b, c, d, e, f, g, h, a, i, 7, WORD); \
+    ROUND(a, b, c, d, e, f, g, h, i, 8, WORD); \
+    ROUND(h, a, b, c, d, e, f, g, i, 9, WORD); \
+    ROUND(g, h, a, b, c, d, e, f, i, 10, WORD); \
+    ROUND(f, g, h, a, b, c, d, e, i, 11, WORD); \
+    ROUND(e, f, g, h, a, b, c, d, i, 12, WORD); \
+    ROUND(d, e, f, g, h, a, b, c, i, 13, WORD); \
+    ROUND(c, d, e, f, g, h, a, b, i, 14, WORD); \
+    ROUND(b, c, d, e, f, g, h, a, i, 15, WORD); \
+  } while(0)
+
+/*
+ * Reads a big endian word, the M3 allows it unaligned
+ */
+static inline uint32_t load_be32(const unsigned char *p){
+  uint32_t x;
+  memcpy(&x, p, sizeof(x));
+  return __builtin_bswap32(x);
+}
+
+static inline void store_be32(unsigned char *p, uint32_t x){
+  x = __builtin_bswap32(x);
+  memcpy(p, &x, sizeof(x));
+}
+
+/*
+ * Runs the compression function over one 64 byte block
+ */
+void sha256_fast_compress(uint32_t *val, const unsigned char *block){
+  uint32_t w[16];
+  uint32_t a = val[0], b = val[1], c = val[2], d = val[3];
+  uint32_t e = val[4], f = val[5], g = val[6], h = val[7];
+  
+  for(int j = 0; j < 16; j++)
+    w[j] = load_be32(block + 4 * j);
+  
+  ROUNDS16(0, W_LOAD);
+  for(int i = 16; i < 64; i += 16)
+    ROUNDS16(i, W_NEXT);
+  
+  val[0] += a; val[1] += b; val[2] += c; val[3] += d;
+  val[4] += e; val[5] += f; val[6] += g; val[7] += h;
+}
+
+static void fast_init(const br_hash_class **ctx){
+  sha256_fast_context *cc = (sha256_fast_context *) ctx;
+  
+  cc->vtable = &sha256_fast_vtable;
+  memcpy(cc->val, IV, sizeof(IV));
+  cc->count = 0;
+}
+
+static void fast_update(const br_hash_class **ctx, const void *data, size_t len){
+  sha256_fast_context *cc = (sha256_fast_context *) ctx;
+  const unsigned char *d = data;
+  size_t have = (size_t) cc->count & (BLOCK_SIZE - 1);
+  
+  cc->count += len;
+  
+  // Top up a partial block first
+  if(have){
+    size_t run = BLOCK_SIZE - have;
+    if(run > len)
+      run = len;
+    memcpy(cc->buf + have, d, run);
+    d += run;
+    len -= run;
+    if(have + run < BLOCK_SIZE)
+      return;
+    sha256_fast_compress(cc->val, cc->buf);
+  }
+  
+  // Whole blocks straight from the input
+  while(len >= BLOCK_SIZE){
+    sha256_fast_compress(cc->val, d);
+    d += BLOCK_SIZE;
+    len -= BLOCK_SIZE;
+  }
+  memcpy(cc->buf, d, len);
+}
+
+static void fast_out(const br_hash_class *const *ctx, void *dst){
+  const sha256_fast_context *cc = (const sha256_fast_context *) ctx;
+  unsigned char buf[BLOCK_SIZE];
+  uint32_t val[8];
+  size_t have = (size_t) cc->count & (BLOCK_SIZE - 1);
+  
+  // Pad a copy, the context can still be updated afterwards
+  memcpy(buf, cc->buf, have);
+  memcpy(val, cc->val, sizeof(val));
+  buf[have++] = 0x80;
+  if(have > BLOCK_SIZE - 8){
+    memset(buf + have, 0, BLOCK_SIZE - have);
+    sha256_fast_compress(val, buf);
+    have = 0;
+  }
+  memset(buf + have, 0, BLOCK_SIZE - 8 - have);
+  store_be32(buf + BLOCK_SIZE - 8, (uint32_t) (cc->count >> 29));
+  store_be32(buf + BLOCK_SIZE - 4, (uint32_t) cc->count << 3);
+  sha256_fast_compress(val, buf);
+  
+  for(int i = 0; i < 8; i++)
+    store_be32((unsigned char *) dst + 4 * i, val[i]);
+}
+
+static uint64_t fast_state(const br_hash_class *const *ctx, void *dst){
+  const sha256_fast_context *cc = (const sha256_fast_context *) ctx;
+  
+  for(int i = 0; i < 8; i++)
+    store_be32((unsigned char *) dst + 4 * i, cc->val[i]);
+  return cc->count;
+}
+
+static void fast_set_state(const br_hash_class **ctx, const void *stb, uint64_t count){
+  sha256_fast_context *cc = (sha256_fast_context *) ctx;
+  
+  for(int i = 0; i < 8; i++)
+    cc->val[i] = load_be32((const unsigned char *) stb + 4 * i);
+  cc->count = count;
+}
+
+const br_hash_class sha256_fast_vtable = {
+  sizeof(sha256_fast_context),
+  BR_HASHDESC_ID(br_sha256_ID)
+    | BR_HASHDESC_OUT(32)
+    | BR_HASHDESC_STATE(32)
+    | BR_HASHDESC_LBLEN(6)
+    | BR_HASHDESC_MD_PADDING
+    | BR_HASHDESC_MD_PADDING_BE,
+  fast_init,
+  fast_update,
+  fast_out,
+  fast_state,
+  fast_set_state
+};
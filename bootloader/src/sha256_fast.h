@@ -0,0 +1,21 @@
+#ifndef SHA256_FAST_H
+#define SHA256_FAST_H
+
+#include <stdint.h>
+
+#include "bearssl.h"
+
+// Same layout as br_sha256_context, so it fits wherever that does
+typedef struct {
+  const br_hash_class *vtable;
+  unsigned char buf[64];
+  uint64_t count;
+  uint32_t val[8];
+} sha256_fast_context;
+
+// Drop-in for br_sha256_vtable, states are interchangeable with it
+extern const br_hash_class sha256_fast_vtable;
+
+void sha256_fast_compress(uint32_t *val, const unsigned char *block);
+
+#endif //SHA256_FAST_H
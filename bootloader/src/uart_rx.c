@@ -0,0 +1,122 @@
+// Hardware Imports
+#include "inc/hw_memmap.h" // Peripheral Base Addresses
+#include "inc/hw_types.h" // Boolean type
+#include "inc/hw_ints.h" // Interrupt numbers
+#include "inc/hw_uart.h" // UART data register bits
+
+// Driver API Imports
+#include "driverlib/interrupt.h" // Interrupt API
+#include "driverlib/uart.h" // UART API
+
+#include <string.h>
+
+#include "uart_rx.h"
+
+/*
+ * Interrupt driven receive side of UART1 (the host connection).
+ * The ISR drains the hardware FIFO into a ring buffer, so bytes keep
+ * arriving while the bootloader is busy hashing, decrypting or flashing.
+ * Only the ISR moves head and only the reader moves tail.
+ */
+
+#define UART_RX_MASK (UART_RX_SIZE - 1)
+
+static volatile uint8_t ring[UART_RX_SIZE];
+static volatile uint32_t head = 0;
+static volatile uint32_t tail = 0;
+
+volatile uint32_t uart_rx_dropped = 0;
+volatile uint32_t uart_rx_overruns = 0;
+volatile uint32_t uart_rx_errors = 0;
+
+/*
+ * Enables the UART1 receive and receive timeout interrupts.
+    Must be called after uart_init(UART1).
+ */
+void uart_rx_init(void){
+  head = 0;
+  tail = 0;
+  
+  // Interrupt at half a FIFO, the timeout catches whatever is left over
+  UARTFIFOLevelSet(UART1_BASE, UART_FIFO_TX4_8, UART_FIFO_RX4_8);
+  UARTIntEnable(UART1_BASE, UART_INT_RX | UART_INT_RT | UART_INT_OE);
+  IntEnable(INT_UART1);
+}
+
+/*
+ * Moves everything in the hardware FIFO into the ring
+ */
+void UART1_IRQHandler(void){
+  unsigned long status = UARTIntStatus(UART1_BASE, true);
+  UARTIntClear(UART1_BASE, status);
+  
+  while(UARTCharsAvail(UART1_BASE)){
+    unsigned long dr = (unsigned long) UARTCharGetNonBlocking(UART1_BASE);
+    
+    // The data register reports errors alongside the byte they happened on
+    if(dr & UART_DR_OE)
+      uart_rx_overruns++;
+    if(dr & (UART_DR_FE | UART_DR_PE | UART_DR_BE))
+      uart_rx_errors++;
+    
+    if(head - tail >= UART_RX_SIZE){
+      uart_rx_dropped++;
+      continue;
+    }
+    ring[head & UART_RX_MASK] = (uint8_t) (dr & UART_DR_DATA_M);
+    head++;
+  }
+}
+
+/*
+ * Number of bytes waiting in the ring
+ */
+uint32_t uart_rx_available(void){
+  return head - tail;
+}
+
+/*
+ * Reads one byte, blocking until it arrives
+ */
+uint8_t uart_rx_read_byte(void){
+  uint8_t byte;
+  
+  while(head == tail){
+  }
+  byte = ring[tail & UART_RX_MASK];
+  tail++;
+  return byte;
+}
+
+/*
+ * Reads len bytes into buf, blocking until all of them arrived.
+    Copies whole runs out of the ring instead of going byte by byte.
+ */
+void uart_rx_read(uint8_t *buf, uint32_t len){
+  while(len){
+    uint32_t avail;
+    
+    while((avail = head - tail) == 0){
+    }
+    
+    // Stop at the end of the ring, the next pass picks up the wrapped part
+    uint32_t offset = tail & UART_RX_MASK;
+    uint32_t run = UART_RX_SIZE - offset;
+    if(run > avail)
+      run = avail;
+    if(run > len)
+      run = len;
+    
+    memcpy(buf, (const uint8_t *) ring + offset, run);
+    tail += run;
+    buf += run;
+    len -= run;
+  }
+}
+
+/*
+ * Throws away everything received so far
+ */
+void uart_rx_flush(void){
+  tail = head;
+}
@@ -0,0 +1,20 @@
+#ifndef UART_RX_H
+#define UART_RX_H
+
+#include <stdint.h>
+
+// Size of the UART1 receive ring, must be a power of two
+#define UART_RX_SIZE 4096
+
+// Receive error counters, only ever incremented by the ISR
+extern volatile uint32_t uart_rx_dropped;  // Bytes lost because the ring was full
+extern volatile uint32_t uart_rx_overruns; // Bytes lost in the hardware FIFO
+extern volatile uint32_t uart_rx_errors;   // Framing, parity and break errors
+
+void uart_rx_init(void);
+uint32_t uart_rx_available(void);
+uint8_t uart_rx_read_byte(void);
+void uart_rx_read(uint8_t *buf, uint32_t len);
+void uart_rx_flush(void);
+
+#endif //UART_RX_H
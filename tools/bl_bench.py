@@ -0,0 +1,421 @@
+#!/usr/bin/env python
+"""
+Update Benchmark Tool
+
+Builds the bootloader, starts it under QEMU with bl_emulate.py and times
+updates of synthetic firmware from 1 KB up to the 30 KB the bootloader
+takes. Every image is protected with fw_protect.py and sent with
+fw_update.py, the same code paths a real update takes.
+
+Each run appends an entry to a JSON history file:
+
+{"commit": ..., "dirty": ..., "date": ..., "config": {...},
+ "results": [{"size": ..., "wall": ..., "bytes_tx": ..., "bytes_rx": ...,
+              "phases": {"baud": ..., "handshake": ..., "frames": ..., "finish": ...}}]}
+
+Times are seconds, the median over --runs updates of each size. Bytes are
+what crossed the host port in both directions.
+
+With --restore the device is saved as a QEMU snapshot once it has booted,
+and restored before every update, so each one starts from the same flash
+and none pays for what the one before it left behind.
+
+With --link the updates go through bl_link.py, which gives the line a real
+baud rate, latency and errors, for example --link "--baud 115200 --flip-rate 1e-6".
+Failed updates are then resumed up to --retries times, and how often that
+took is kept with each size.
+
+With --sparse every update is a fw_protect.py --skip-unchanged one, of an
+image whose every other page changed since the one installed before it
+(untimed) in the same run. The firmware is read back through the QEMU
+monitor afterwards, so a page flashed from the wrong buffer fails the run
+even though its MAC checked out.
+
+With --compare A B nothing is run. The latest entries of the two commits
+(or the two latest entries, without arguments) are compared size by size,
+and any update that got slower by more than --threshold is flagged. The
+exit status is nonzero if one did.
+"""
+
+import argparse
+import datetime
+import json
+import os
+import pathlib
+import random
+import shlex
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+from serial import Serial
+
+import bl_emulate
+import fw_protect
+import fw_update
+
+FILE_DIR = pathlib.Path(__file__).parent.absolute()
+
+# Biggest image the bootloader takes, FW_MAX_SIZE, and where it is, FW_BASE
+FW_MAX_SIZE = 0x7800
+FW_BASE = 0x10000
+# One size ends part way into a page, so the short last frame is covered as well
+DEFAULT_SIZES = [1024, 2048, 4096, 5000, 8192, 16384, FW_MAX_SIZE]
+HOST_PORT = '/embsec/UART1'
+MONITOR = '/embsec/monitor.sock'
+LINK_PORT = '/embsec/UART1.link'
+# Snapshot every update starts from with --restore
+BENCH_SNAPSHOT = 'bench'
+# First boot flashes the embedded firmware before the bootloader listens
+BOOT_SETTLE = 3.0
+
+
+class CountingSerial:
+    """
+    Wraps a serial port and counts the bytes that go through it
+    """
+    def __init__(self, ser):
+        self.ser = ser
+        self.tx = 0
+        self.rx = 0
+
+    def write(self, data):
+        self.tx += len(data)
+        return self.ser.write(data)
+
+    def read(self, size=1):
+        data = self.ser.read(size)
+        self.rx += len(data)
+        return data
+
+    def __getattr__(self, name):
+        return getattr(self.ser, name)
+
+    def __setattr__(self, name, value):
+        # Baud rate changes have to reach the real port
+        if name in ('ser', 'tx', 'rx'):
+            object.__setattr__(self, name, value)
+        else:
+            setattr(self.ser, name, value)
+
+
+def git_commit():
+    """
+    Return:
+        The commit being benchmarked and whether the tree has changes on top of it
+    """
+    commit = subprocess.run(['git', 'rev-parse', 'HEAD'], cwd=FILE_DIR, capture_output=True, text=True).stdout.strip()
+    dirty = subprocess.run(['git', 'status', '--porcelain', '--untracked-files=no'], cwd=FILE_DIR,
+                           capture_output=True, text=True).stdout.strip() != ''
+    return commit, dirty
+
+
+def build_bootloader(aes, ghash, sha):
+    """
+    Builds the bootloader with fresh keys, like bl_build.py does
+    Return:
+        None
+    """
+    status = subprocess.call([sys.executable, 'bl_build.py', '--aes', aes, '--ghash', ghash, '--sha', sha], cwd=FILE_DIR)
+    if status:
+        raise RuntimeError('ERROR: Bootloader build failed')
+
+
+def start_emulator(boot_path=None, serial='pty', snapshots=None):
+    """
+    Starts QEMU through bl_emulate.py and waits for the bootloader to listen.
+    QEMU's own ptys keep the relay out of the numbers unless serial says otherwise.
+    Return:
+        The bl_emulate.py process
+    """
+    cmd = [sys.executable, 'bl_emulate.py', '--serial', serial]
+    if boot_path is not None:
+        cmd += ['--boot-path', str(boot_path)]
+    if snapshots is not None:
+        cmd += ['--snapshots', str(snapshots)]
+    emulator = subprocess.Popen(cmd, cwd=FILE_DIR, stdout=subprocess.DEVNULL)
+
+    deadline = time.time() + 10
+    while not os.path.exists(HOST_PORT):
+        if time.time() > deadline or emulator.poll() is not None:
+            emulator.kill()
+            raise RuntimeError('ERROR: Emulator did not come up')
+        time.sleep(0.1)
+    time.sleep(BOOT_SETTLE)
+    return emulator
+
+
+def stop_emulator(emulator):
+    """
+    Stops bl_emulate.py, which stops the QEMU it started
+    Return:
+        None
+    """
+    emulator.terminate()
+    emulator.wait()
+
+
+def start_link(link_args):
+    """
+    Starts bl_link.py in front of the host port and waits for its port.
+    Return:
+        The bl_link.py process
+    """
+    if os.path.lexists(LINK_PORT):
+        os.unlink(LINK_PORT)
+    link = subprocess.Popen([sys.executable, 'bl_link.py', '--device', HOST_PORT, '--port', LINK_PORT]
+                            + shlex.split(link_args), cwd=FILE_DIR)
+    deadline = time.time() + 10
+    while not os.path.exists(LINK_PORT):
+        if time.time() > deadline or link.poll() is not None:
+            link.kill()
+            raise RuntimeError('ERROR: Link emulator did not come up')
+        time.sleep(0.1)
+    return link
+
+
+def synthetic_firmware(size):
+    """
+    Makes an image that looks like code: random, but the same for every run of a size.
+    Return:
+        size bytes
+    """
+    rng = random.Random(size)
+    return bytes(rng.getrandbits(8) for _ in range(size))
+
+
+def sparse_firmware(size):
+    """
+    Makes the image a --sparse update installs: synthetic_firmware(size) with
+    the first page and every other one after it changed.
+    Return:
+        size bytes
+    """
+    image = bytearray(synthetic_firmware(size))
+    for start in range(0, size, fw_update.PG_SIZE * 2):
+        for i in range(start, min(start + fw_update.PG_SIZE, size)):
+            image[i] ^= 0xFF
+    return bytes(image)
+
+
+def check_flash(monitor, image, workdir):
+    """
+    Reads the installed firmware back through the QEMU monitor and compares it with image.
+    Return:
+        None
+    """
+    dump = workdir / 'flash.bin'
+    monitor.pmemsave(FW_BASE, len(image), str(dump))
+    flashed = dump.read_bytes()
+    if flashed != image:
+        first = next(i for i in range(len(image)) if flashed[i] != image[i])
+        raise RuntimeError(f'ERROR: Flash differs from the image from byte {first:#x}, page {first // fw_update.PG_SIZE}')
+
+
+def bench_size(ser, size, runs, window, baud, resume, workdir, monitor=None, retries=0, restore=False, sparse=False):
+    """
+    Protects an image of size bytes and sends it runs times.
+    With restore, the device is restored to BENCH_SNAPSHOT through monitor before each of them.
+    A failed update is resumed up to retries times, the time that takes is part of the run.
+    With sparse, synthetic_firmware(size) is installed before every run and only the pages
+    sparse_firmware(size) changed are sent. The flash is checked through monitor after.
+    Return:
+        Result entry for the history
+    """
+    image = sparse_firmware(size) if sparse else synthetic_firmware(size)
+    # Version 0 is the debug version, it installs over anything
+    blob = fw_protect.protect_firmware(infile=None, outfile=str(workdir / f'fw_{size}.prot'), version=0,
+                                       message=f'bench {size}', skip_unchanged=sparse, firmware=image)
+    if sparse:
+        base_blob = fw_protect.protect_firmware(infile=None, outfile=str(workdir / f'fw_{size}.base.prot'), version=0,
+                                                message=f'bench {size} base', firmware=synthetic_firmware(size))
+
+    walls, txs, rxs, phases, retried = [], [], [], [], []
+    for _ in range(runs):
+        if restore:
+            # Back at boot, and at the rate it boots with
+            monitor.loadvm(BENCH_SNAPSHOT)
+            ser.baudrate = fw_update.BAUD_DEFAULT
+            ser.reset_input_buffer()
+        if sparse:
+            # Untimed, puts the pages that stay the same in flash
+            fw_update.send_update(ser, base_blob, False, window, baud, resume)
+        counted = CountingSerial(ser)
+        phase = {}
+        start = time.perf_counter()
+        for attempt in range(retries + 1):
+            try:
+                fw_update.send_update(counted, blob, False, window, baud, resume, phases=phase)
+                break
+            except RuntimeError:
+                if attempt == retries:
+                    raise
+                fw_update.recover(counted)
+        walls.append(time.perf_counter() - start)
+        if sparse:
+            check_flash(monitor, image, workdir)
+        retried.append(attempt)
+        txs.append(counted.tx)
+        rxs.append(counted.rx)
+        phases.append(phase)
+
+    return {
+        'size': size,
+        'blob': len(blob),
+        'wall': statistics.median(walls),
+        'bytes_tx': statistics.median(txs),
+        'bytes_rx': statistics.median(rxs),
+        'retries': sum(retried),
+        'phases': {name: statistics.median(p.get(name, 0) for p in phases) for name in phases[0]},
+    }
+
+
+def run(args):
+    """
+    Runs the whole suite and appends it to the history.
+    Return:
+        The history entry
+    """
+    config = {'aes': args.aes, 'ghash': args.ghash, 'sha': args.sha, 'window': args.window,
+              'baud': args.baud, 'resume': not args.no_resume, 'runs': args.runs, 'serial': args.serial,
+              'restore': args.restore, 'link': args.link, 'retries': args.retries, 'sparse': args.sparse}
+    if not args.no_build:
+        build_bootloader(args.aes, args.ghash, args.sha)
+
+    # fw_protect.py reads its keys relative to the working directory
+    os.chdir(FILE_DIR)
+    results = []
+    with tempfile.TemporaryDirectory() as tmp:
+        tmp = pathlib.Path(tmp)
+        emulator = start_emulator(args.boot_path, args.serial, tmp / 'bench.qcow2' if args.restore else None)
+        monitor = None
+        link = None
+        try:
+            if args.link is not None:
+                link = start_link(args.link)
+            ser = Serial(LINK_PORT if link else HOST_PORT, baudrate=fw_update.BAUD_DEFAULT, timeout=2)
+            if args.restore or args.sparse:
+                monitor = bl_emulate.Monitor(MONITOR)
+            if args.restore:
+                monitor.savevm(BENCH_SNAPSHOT)
+            for size in args.sizes:
+                result = bench_size(ser, size, args.runs, args.window, args.baud, not args.no_resume, tmp, monitor,
+                                    args.retries, args.restore, args.sparse)
+                print(f"{size:>6} bytes: {result['wall']:.3f} s, {result['bytes_tx']} bytes out, "
+                      f"{result['bytes_rx']} bytes in, {result['retries']} retries")
+                results.append(result)
+        finally:
+            if monitor is not None:
+                monitor.close()
+            if link is not None:
+                link.terminate()
+                link.wait()
+            stop_emulator(emulator)
+
+    commit, dirty = git_commit()
+    entry = {'commit': commit, 'dirty': dirty, 'date': datetime.datetime.now().isoformat(timespec='seconds'),
+             'config': config, 'results': results}
+
+    history = load_history(args.history)
+    history.append(entry)
+    with open(args.history, 'w') as fp:
+        json.dump(history, fp, indent=1)
+    return entry
+
+
+def load_history(path):
+    """
+    Return:
+        Every entry of the history file, oldest first
+    """
+    if not os.path.exists(path):
+        return []
+    with open(path) as fp:
+        return json.load(fp)
+
+
+def find_entry(history, commit):
+    """
+    Return:
+        The latest entry of a commit, which may be given abbreviated
+    """
+    for entry in reversed(history):
+        if entry['commit'].startswith(commit):
+            return entry
+    raise RuntimeError(f'ERROR: No benchmark of {commit} in the history')
+
+
+def compare(old, new, threshold):
+    """
+    Prints the change of every size between two entries.
+    Return:
+        Whether anything got slower by more than threshold
+    """
+    if old['config'] != new['config']:
+        print('Warning: the two runs used different settings, '
+              f"{old['config']} against {new['config']}")
+
+    before = {r['size']: r for r in old['results']}
+    slower = False
+    print(f"{old['commit'][:10]} -> {new['commit'][:10]}{' (dirty)' if new['dirty'] else ''}")
+    for r in new['results']:
+        if r['size'] not in before:
+            continue
+        was = before[r['size']]['wall']
+        change = (r['wall'] - was) / was if was else 0
+        flag = change > threshold
+        slower |= flag
+        print(f"{r['size']:>6} bytes: {was:.3f} s -> {r['wall']:.3f} s ({change:+.1%})"
+              f"{'  SLOWER' if flag else ''}")
+        if flag:
+            # Point at the part of the update that grew the most
+            phases = before[r['size']]['phases']
+            worst = max(r['phases'], key=lambda name: r['phases'][name] - phases.get(name, 0))
+            print(f"        most of it in {worst}: {phases.get(worst, 0):.3f} s -> {r['phases'][worst]:.3f} s")
+    return slower
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Update Benchmark Tool')
+    parser.add_argument("--history", help="JSON file the results are appended to.", default='bench_history.json')
+    parser.add_argument("--sizes", help="Image sizes to update with, in bytes.", type=int, nargs='+', default=DEFAULT_SIZES)
+    parser.add_argument("--runs", help="Updates per size, the median is kept.", type=int, default=3)
+    parser.add_argument("--window", help="Number of frames to keep in flight.", type=int, default=1)
+    parser.add_argument("--baud", help="Baud rate to negotiate for each update.", type=int, default=fw_update.BAUD_DEFAULT)
+    parser.add_argument("--no-resume", help="Start updates with 'U'/'W' instead of 'J'.", action='store_true')
+    parser.add_argument("--aes", help="AES implementation to build with.", choices=['ct', 'small', 'big', 'fast'], default='ct')
+    parser.add_argument("--ghash", help="GHASH implementation to build with.", choices=['ctmul', 'ctmul32', 'ctmul64', '4bit'], default='ctmul32')
+    parser.add_argument("--sha", help="SHA-256 implementation to build with.", choices=['fast', 'bearssl'], default='fast')
+    parser.add_argument("--no-build", help="Use the bootloader and keys that are already built.", action='store_true')
+    parser.add_argument("--boot-path", help="Path to the bootloader binary.", default=None)
+    parser.add_argument("--serial", help="How bl_emulate.py exposes the UARTs.", choices=['tcp', 'pty'], default='pty')
+    parser.add_argument("--restore", help="Restore the device to a snapshot taken at boot before every update.",
+                        action='store_true')
+    parser.add_argument("--sparse", help="Send only every other page, over an image installed first, and check the flash.",
+                        action='store_true')
+    parser.add_argument("--link", help="Send through bl_link.py with these arguments.", default=None)
+    parser.add_argument("--retries", help="Times a failed update is resumed before the run fails.", type=int, default=0)
+    parser.add_argument("--compare", help="Compare two commits from the history instead, the two latest entries by default.",
+                        nargs='*', metavar='COMMIT')
+    parser.add_argument("--threshold", help="Slowdown that is flagged, as a fraction.", type=float, default=0.05)
+    args = parser.parse_args()
+
+    for size in args.sizes:
+        if not 0 < size <= FW_MAX_SIZE:
+            parser.error(f"sizes have to be between 1 and {FW_MAX_SIZE}")
+    args.history = os.path.abspath(args.history)
+
+    if args.compare is None:
+        run(args)
+        sys.exit(0)
+
+    history = load_history(args.history)
+    if len(args.compare) == 2:
+        old, new = find_entry(history, args.compare[0]), find_entry(history, args.compare[1])
+    elif not args.compare and len(history) >= 2:
+        old, new = history[-2], history[-1]
+    else:
+        parser.error("--compare takes two commits, or none to compare the two latest entries")
+    sys.exit(1 if compare(old, new, args.threshold) else 0)
@@ -20,12 +20,148 @@ from Crypto.Random import get_random_bytes
 
 FILE_DIR = pathlib.Path(__file__).parent.absolute()
 
+# SHA-256 round constants
+SHA256_K = [
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+]
+# SHA-256 initial state
+SHA256_IV = [0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19]
+SHA256_BLOCK_SIZE = 64
+
+
+def sha256_compress(state, block):
+    """
+    Runs the SHA-256 compression function over one 64 byte block.
+    hashlib does not hand out the state in the middle of a hash, so this is done by hand.
+    Return:
+        The new state, 8 words
+    """
+    ror = lambda x, n: ((x >> n) | (x << (32 - n))) & 0xFFFFFFFF
+    
+    w = list(struct.unpack(">16I", block))
+    for i in range(16, 64):
+        s0 = ror(w[i-15], 7) ^ ror(w[i-15], 18) ^ (w[i-15] >> 3)
+        s1 = ror(w[i-2], 17) ^ ror(w[i-2], 19) ^ (w[i-2] >> 10)
+        w.append((w[i-16] + s0 + w[i-7] + s1) & 0xFFFFFFFF)
+    
+    a, b, c, d, e, f, g, h = state
+    for i in range(64):
+        t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i]
+        t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c))
+        a, b, c, d, e, f, g, h = (t1 + t2) & 0xFFFFFFFF, a, b, c, (d + t1) & 0xFFFFFFFF, e, f, g
+    
+    return [(x + y) & 0xFFFFFFFF for x, y in zip(state, [a, b, c, d, e, f, g, h])]
+
+
+def hmac_key_states(key):
+    """
+    Precomputes what br_hmac_key_init() would: the SHA-256 state after the
+    inner (key ^ ipad) and outer (key ^ opad) key blocks, as BearSSL stores them.
+    Return:
+        ksi and kso, 32 bytes each
+    """
+    key = key.ljust(SHA256_BLOCK_SIZE, b'\x00')
+    ksi = sha256_compress(SHA256_IV, bytes(b ^ 0x36 for b in key))
+    kso = sha256_compress(SHA256_IV, bytes(b ^ 0x5C for b in key))
+    return struct.pack(">8I", *ksi), struct.pack(">8I", *kso)
+
+
+def aes_sbox():
+    """
+    Builds the AES S-box, the inverse in GF(2^8) followed by the affine map.
+    Return:
+        The S-box as a list of 256 ints
+    """
+    def mul(a, b):
+        r = 0
+        while b:
+            if b & 1:
+                r ^= a
+            a = ((a << 1) ^ (0x11B if a & 0x80 else 0)) & 0xFF
+            b >>= 1
+        return r
+    
+    sbox = []
+    for x in range(256):
+        inv = next((y for y in range(1, 256) if mul(x, y) == 1), 0)
+        s = inv
+        for shift in range(1, 5):
+            s ^= ((inv << shift) | (inv >> (8 - shift))) & 0xFF
+        sbox.append(s ^ 0x63)
+    return sbox
+
+
+def aes128_expand_key(key):
+    """
+    Expands an AES-128 key into its 44 round key words, each decoded little endian like BearSSL does.
+    Return:
+        The round key words
+    """
+    sbox = aes_sbox()
+    sub_word = lambda x: sum(sbox[(x >> (8 * i)) & 0xFF] << (8 * i) for i in range(4))
+    
+    words = list(struct.unpack("<4I", key))
+    rcon = 1
+    for i in range(4, 44):
+        tmp = words[i-1]
+        if i % 4 == 0:
+            tmp = sub_word(((tmp << 24) | (tmp >> 8)) & 0xFFFFFFFF) ^ rcon
+            rcon = ((rcon << 1) ^ (0x11B if rcon & 0x80 else 0)) & 0xFF
+        words.append(words[i-4] ^ tmp)
+    return words
+
+
+def aes_ct_keysched(key):
+    """
+    Precomputes what br_aes_ct_keysched() would for an AES-128 key: the round keys
+    in the bitsliced form of aes_ct, compressed to one word per round key word.
+    Return:
+        The 44 words of the compressed key schedule
+    """
+    def swap(q, x, y, cl, ch, s):
+        a, b = q[x], q[y]
+        q[x] = (a & cl) | ((b & cl) << s) & 0xFFFFFFFF
+        q[y] = ((a & ch) >> s) | (b & ch)
     
+    def ortho(q):
+        for x, y in ((0, 1), (2, 3), (4, 5), (6, 7)):
+            swap(q, x, y, 0x55555555, 0xAAAAAAAA, 1)
+        for x, y in ((0, 2), (1, 3), (4, 6), (5, 7)):
+            swap(q, x, y, 0x33333333, 0xCCCCCCCC, 2)
+        for x, y in ((0, 4), (1, 5), (2, 6), (3, 7)):
+            swap(q, x, y, 0x0F0F0F0F, 0xF0F0F0F0, 4)
+    
+    # Every word is doubled, then each round key is orthogonalized as 8 words
+    skey = [w for w in aes128_expand_key(key) for _ in range(2)]
+    for i in range(0, len(skey), 8):
+        q = skey[i:i+8]
+        ortho(q)
+        skey[i:i+8] = q
+    
+    return [(skey[j] & 0x55555555) | (skey[j+1] & 0xAAAAAAAA) for j in range(0, len(skey), 2)]
+
+
+def c_bytes(data):
+    """
+    Formats bytes as the body of a C array initializer
+    """
+    return ', '.join(f'0x{b:02x}' for b in data)
+
+
 def write_secret():
     """
     Generates 16-byte AES128-GCM key and 32-byte HMAC key.
     Writes both keys into ./secret_build_output.txt for fw_protect to access.
-    Writes both keys into ../bootloader/src/secrets.h for bootloader.c to access.
+    Writes both keys into ../bootloader/src/secrets.h for bootloader.c to access,
+    along with what the bootloader would otherwise derive from them on every update:
+    the HMAC inner/outer states, the aes_ct key schedule and the GHASH key.
     Return:
         None
     """
@@ -53,10 +189,29 @@ def write_secret():
         s2 = '{' + s2[0:len(s2)-1] + '};\n\n'
         s2 = 'const unsigned char hmac_key[] = ' + s2
         
+        # Inner and outer HMAC states, in a br_hmac_key_context
+        ksi, kso = hmac_key_states(bytes.fromhex(hmackey))
+        s3 = ('const br_hmac_key_context hmac_key_ctx = {\n'
+              '  &sha256_backend,\n'
+              '  {' + c_bytes(ksi) + '},\n'
+              '  {' + c_bytes(kso) + '}\n'
+              '};\n\n')
+        
+        # Compressed aes_ct round keys and the GHASH key H = AES(0)
+        skey = aes_ct_keysched(bytes.fromhex(aes_key))
+        s4 = ('const uint32_t aes_ct_skey[] = {' + ', '.join(f'0x{w:08x}' for w in skey) + '};\n'
+              '#define AES_NUM_ROUNDS 10\n\n')
+        gcm_h = AES.new(bytes.fromhex(aes_key), AES.MODE_ECB).encrypt(bytes(16))
+        s5 = 'const unsigned char gcm_h[] = {' + c_bytes(gcm_h) + '};\n'
+        
         fp.write('#ifndef SECRETS_H\n')
         fp.write('#define SECRETS_H\n')
+        fp.write('#include "crypto_backend.h"\n\n')
         fp.write(s1)
         fp.write(s2)
+        fp.write(s3)
+        fp.write(s4)
+        fp.write(s5)
         fp.write('\n#endif //SECRETS_H')
 
 
@@ -72,9 +227,9 @@ def copy_initial_firmware(binary_path):
     shutil.copy(binary_path, bootloader / 'src' / 'firmware.bin')
 
 
-def make_bootloader():
+def make_bootloader(aes='ct', ghash='ctmul32', sha='fast'):
     """
-    Build the bootloader from source.
+    Build the bootloader from source, with the given AES, GHASH and SHA-256 implementations.
 
     Return:
         True if successful, False otherwise.
@@ -84,7 +239,7 @@ def make_bootloader():
     os.chdir(bootloader)
 
     subprocess.call('make clean', shell=True)
-    status = subprocess.call('make')
+    status = subprocess.call(['make', f'AES={aes}', f'GHASH={ghash}', f'SHA={sha}'])
 
     # Return True if make returned 0, otherwise return False.
     return (status == 0)
@@ -93,6 +248,9 @@ def make_bootloader():
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description='Bootloader Build Tool')
     parser.add_argument("--initial-firmware", help="Path to the the firmware binary.", default=None)
+    parser.add_argument("--aes", help="AES implementation to build with.", choices=['ct', 'small', 'big', 'fast'], default='ct')
+    parser.add_argument("--ghash", help="GHASH implementation to build with.", choices=['ctmul', 'ctmul32', 'ctmul64', '4bit'], default='ctmul32')
+    parser.add_argument("--sha", help="SHA-256 implementation to build with.", choices=['fast', 'bearssl'], default='fast')
     args = parser.parse_args()
     if args.initial_firmware is None:
         binary_path = FILE_DIR / '..' / 'firmware' / 'firmware' / 'gcc' / 'main.bin'
@@ -105,4 +263,4 @@ if __name__ == '__main__':
 
     write_secret()
     copy_initial_firmware(binary_path)
-    make_bootloader()
\ No newline at end of file
+    make_bootloader(aes=args.aes, ghash=args.ghash, sha=args.sha)
\ No newline at end of file
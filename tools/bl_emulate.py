@@ -1,92 +1,548 @@
+"""
+Stellaris Emulator
+
+Runs the bootloader under QEMU's lm3s6965evb and exposes its three UARTs as
+/embsec/UART0, /embsec/UART1 (the host port) and /embsec/UART2 (debug).
+How they get there depends on --serial:
+
+tcp   QEMU listens on TCP ports 13337-13339 and a relay bridges each one
+      to a pty. The relay forwards from one selector, everything that is
+      ready as soon as it is ready.
+pty   QEMU opens the ptys itself and /embsec/UART* point at them. No relay,
+      so timing is the bootloader's alone.
+unix  QEMU listens on the unix sockets /embsec/UART*.sock. No relay either,
+      fw_fleet.py takes them as unix:/embsec/UART1.sock.
+
+With --instances N, N devices run side by side, each with its UARTs in its
+own directory (/embsec/dev0/UART1, ...) and TCP and GDB ports picked from
+the free ones. Every QEMU has its monitor on monitor.sock in its directory.
+--inventory writes where everything is as JSON once all are up:
+
+{"instances": [{"index": 0, "pid": ..., "dir": "/embsec/dev0", "monitor": ...,
+                "gdb": ..., "host": <UART1, as fw_fleet.py --port takes it>,
+                "uarts": [{"name": "UART0", "path": ..., "tcp": ...}, ...]}]}
+
+Only the QEMUs started here are stopped again, on exit or SIGTERM, and their
+ports, sockets and the inventory are removed.
+
+With --snapshots IMAGE, a qcow2 image (made if missing) is attached that
+QEMU keeps savevm snapshots in. The board has no disk, so the image only
+holds snapshots. A device brought into a known state once, for example
+"v2 installed, waiting for U", can be saved on a running instance with
+--save NAME, and restored with --restore NAME or started straight in it
+with --loadvm NAME. Either takes milliseconds, with no boot and no
+flashing of the initial firmware. With several instances every one runs on
+its own copy of the image, so restoring is shared but saving is not kept.
+
+QEMU's flash is really RAM and starts out blank. With --flash IMAGE the part
+the bootloader writes, from the journal at 0xF400 to the end of the
+firmware at 0x17800, is dumped through the monitor when the instance stops
+and loaded back when it starts. The installed firmware, its metadata and
+release message, and an unfinished update then survive from one run to the
+next. QEMU writes the image into flash once, so device resets keep what
+was flashed since. Several instances each get their own image
+(flash.bin becomes flash.0.bin, ...).
+
+Next to every image, IMAGE.wear.json counts for each page how many dumps
+found it changed. A page rewritten with what it held is not counted, so the
+counts are a lower bound of the page's erase cycles.
+"""
+
 import argparse
+import json
 import pathlib
 import os
 import pty
+import re
+import selectors
+import signal
+import socket
 import subprocess
-import fcntl
+import sys
 import threading
 import time
+import shutil
+import tty
+
+UART_COUNT = 3
+# Ports of a single instance, more instances take whatever is free
+TCP_PORTS = [13337, 13338, 13339]
+GDB_PORT = 1234
+PORT_DIR = '/embsec'
+# QEMU only starts once the relay is connected to every port
+CONNECT_TIMEOUT = 10
+# Time QEMU gets to exit before it is killed
+STOP_TIMEOUT = 5
+# Most the relay reads at once, and holds for a side that is not reading. Past that the
+# oldest bytes go, like on a UART nobody listens to
+RELAY_CHUNK = 1 << 16
+RELAY_BACKLOG = 1 << 20
+# How QEMU reports the ptys it opened with -serial pty
+PTY_REDIRECT = re.compile(r'char device redirected to (\S+) \(label serial(\d+)\)')
+# Flash the bootloader writes, JOURNAL_BASE up to FW_BASE + FW_MAX_SIZE in bootloader.c
+FLASH_STATE_BASE = 0xF400
+FLASH_STATE_SIZE = 0x10000 + 0x7800 - FLASH_STATE_BASE
+FLASH_PAGESIZE = 1024
+# Size of a new snapshot image, it grows with the snapshots in it
+SNAPSHOT_IMAGE_SIZE = '1M'
+MONITOR_PROMPT = b'(qemu) '
+MONITOR_TIMEOUT = 10
+# The monitor edits its command line like a terminal would
+TERMINAL_ESCAPE = re.compile(r'\x1b\[[0-9;]*[A-Za-z]')
 
-from core.pseudo_serial import SocketSerial
 
+class Relay:
+    """
+    Bridges pairs of file descriptors from one selector, with no polling or sleeps in between
+    """
+    def __init__(self):
+        self.sel = selectors.DefaultSelector()
+        self.peer = {}
+        self.pending = {}
 
-def set_nonblocking(fd):
-    """Make a file_handle non-blocking."""
-    global OFLAGS
-    OFLAGS = fcntl.fcntl(fd, fcntl.F_GETFL)
-    nflags = OFLAGS | os.O_NONBLOCK
-    fcntl.fcntl(fd, fcntl.F_SETFL, nflags)
+    def add(self, a, b):
+        for fd in (a, b):
+            os.set_blocking(fd, False)
+            self.pending[fd] = bytearray()
+            self.sel.register(fd, selectors.EVENT_READ)
+        self.peer[a] = b
+        self.peer[b] = a
+
+    def send(self, fd, data):
+        """
+        Writes straight away, and keeps what the other side did not take yet
+        """
+        pending = self.pending[fd]
+        if not pending:
+            try:
+                data = data[os.write(fd, data):]
+            except BlockingIOError:
+                pass
+        if data:
+            pending += data
+            del pending[:-RELAY_BACKLOG]
+            self.sel.modify(fd, selectors.EVENT_READ | selectors.EVENT_WRITE)
 
+    def flush(self, fd):
+        pending = self.pending[fd]
+        try:
+            del pending[:os.write(fd, pending)]
+        except BlockingIOError:
+            return
+        if not pending:
+            self.sel.modify(fd, selectors.EVENT_READ)
 
-def disable_local_echo(fd):
-    import termios
-    new = termios.tcgetattr(fd)  # [iflag, oflag, cflag, lflag, ispeed, ospeed, cc]
-    new[3] = new[3] & ~termios.ECHO  # Disable Echo lflags
-    new[3] = new[3] & ~termios.ICANON  # Disable line buffer lflags
-    termios.tcsetattr(fd, termios.TCSADRAIN, new)
+    def close(self, fd):
+        for end in (fd, self.peer[fd]):
+            self.sel.unregister(end)
+            del self.peer[end]
 
+    def run(self):
+        """
+        Relays until QEMU closes every port
+        """
+        while self.peer:
+            for key, events in self.sel.select():
+                fd = key.fd
+                if fd not in self.peer:
+                    continue
+                if events & selectors.EVENT_WRITE:
+                    self.flush(fd)
+                if events & selectors.EVENT_READ:
+                    try:
+                        data = os.read(fd, RELAY_CHUNK)
+                    except BlockingIOError:
+                        continue
+                    except OSError:
+                        data = b''
+                    if not data:
+                        self.close(fd)
+                        continue
+                    self.send(self.peer[fd], data)
 
-def connect_socks(ser, fd):
-    def _connect_socks():
-        set_nonblocking(fd)
-        disable_local_echo(fd)
-        while ser.isOpen():
-            if ser.isOpen():
-                data0 = ser.read(100, timeout=.1)
-                if len(data0):
-                    os.write(fd, data0)
 
+class Monitor:
+    """
+    QEMU's human monitor of a running instance, on its unix socket
+    """
+    def __init__(self, path, timeout=MONITOR_TIMEOUT):
+        deadline = time.time() + timeout
+        self.sock = socket.socket(socket.AF_UNIX)
+        while True:
             try:
-                # return 1-n bytes or exception if no bytes
-                time.sleep(.1)
-                data1 = os.read(fd, 1024)
-                if len(data1):
-                    ser.write(data1)
-            except BlockingIOError:
-                pass
+                self.sock.connect(path)
+                break
+            except (FileNotFoundError, ConnectionRefusedError):
+                if time.time() > deadline:
+                    raise RuntimeError(f'ERROR: No QEMU monitor at {path}')
+                time.sleep(0.05)
+        self.sock.settimeout(timeout)
+        self.read_prompt()
+
+    def read_prompt(self):
+        out = b''
+        while not out.endswith(MONITOR_PROMPT):
+            chunk = self.sock.recv(4096)
+            if not chunk:
+                raise RuntimeError('ERROR: QEMU monitor closed')
+            out += chunk
+        return out[:-len(MONITOR_PROMPT)].decode(errors='replace')
+
+    def command(self, line):
+        """
+        Runs a monitor command.
+        Return:
+            What it printed
+        """
+        self.sock.sendall(line.encode() + b'\n')
+        lines = TERMINAL_ESCAPE.sub('', self.read_prompt()).replace('\r', '').split('\n')
+        # The monitor echoes the command first
+        if line in lines[0]:
+            lines = lines[1:]
+        reply = '\n'.join(lines).strip()
+        if reply.startswith('Error'):
+            raise RuntimeError(f'ERROR: {line}: {reply}')
+        return reply
+
+    def savevm(self, name):
+        self.command(f'savevm {name}')
+
+    def loadvm(self, name):
+        self.command(f'loadvm {name}')
+
+    def delvm(self, name):
+        self.command(f'delvm {name}')
+
+    def pmemsave(self, addr, size, path):
+        self.command(f'pmemsave {addr:#x} {size:#x} {os.path.abspath(path)}')
+
+    def snapshots(self):
+        """
+        Return:
+            Names of the snapshots in the image
+        """
+        names = []
+        for line in self.command('info snapshots').splitlines():
+            fields = line.split()
+            if len(fields) >= 2 and (fields[0].isdigit() or fields[0] == '--'):
+                names.append(fields[1])
+        return names
+
+    def close(self):
+        self.sock.close()
+
 
-    t = threading.Thread(target=_connect_socks, daemon=True)
-    t.start()
-    return t
+def count_wear(path, old, new):
+    """
+    Adds the pages that differ between two flash dumps to the counts kept next to the image.
+    A first dump is compared against blank flash.
+    """
+    wear_path = f'{path}.wear.json'
+    wear = {'dumps': 0, 'pages': {}}
+    if os.path.exists(wear_path):
+        with open(wear_path) as fp:
+            wear = json.load(fp)
+    if old is None:
+        old = bytes(len(new))
 
+    wear['dumps'] += 1
+    for offset in range(0, len(new), FLASH_PAGESIZE):
+        if old[offset:offset + FLASH_PAGESIZE] != new[offset:offset + FLASH_PAGESIZE]:
+            page = f'{FLASH_STATE_BASE + offset:#07x}'
+            wear['pages'][page] = wear['pages'].get(page, 0) + 1
+    with open(wear_path, 'w') as fp:
+        json.dump(wear, fp, indent=1, sort_keys=True)
 
-def emulate(binary_path, debug=False):
-    cmd = ['qemu-system-arm', '-M', 'lm3s6965evb', '-nographic', '-kernel', binary_path]
-    if debug:
-        cmd.extend(['-s', '-S'])
-    ports = []
-    for idx, port in enumerate([13337, 13338, 13339]):
-        cmd.extend(['-serial', f'tcp:0.0.0.0:{port},server'])
-        name = f'/embsec/UART{idx}'
-        ports.append((port, name))
 
-    subprocess.call(['pkill', 'qemu'])
-    subprocess.Popen(cmd)
+def free_port():
+    """
+    Return:
+        A TCP port nothing listens on right now
+    """
+    with socket.socket() as s:
+        s.bind(('', 0))
+        return s.getsockname()[1]
 
-    ts = []
-    for port, name in ports:
-        master, slave = pty.openpty()
-        s_name = os.ttyname(slave)
+
+def link_port(target, name):
+    try:
+        os.unlink(name)
+    except FileNotFoundError:
+        pass
+    os.symlink(target, name)
+    print(f'{name} is open')
+
+
+def connect_qemu(port, deadline):
+    """
+    Connects to one of QEMU's UART ports, once it listens.
+    Return:
+        The socket
+    """
+    while True:
         try:
-            os.unlink(name)
-        except FileNotFoundError:
-            pass
-        os.symlink(s_name, name)
+            sock = socket.create_connection(('localhost', port))
+            break
+        except ConnectionRefusedError:
+            if time.time() > deadline:
+                raise RuntimeError(f'ERROR: QEMU did not listen on {port}')
+            time.sleep(0.05)
+    # Frames are written as a whole, acks are single bytes that should not wait for more
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    return sock
+
 
-        ts.append(connect_socks(SocketSerial(name, port, log=False), master))
-        print(f'{name} is open')
+class Instance:
+    """
+    One emulated device: a QEMU, and where its UARTs, monitor and GDB server are
+    """
+    def __init__(self, index, binary_path, port_dir, serial='tcp', debug=False, single=True, snapshots=None,
+                 loadvm=None, flash=None):
+        self.index = index
+        self.binary_path = binary_path
+        self.serial = serial
+        self.debug = debug
+        self.single = single
+        self.dir = port_dir if single else f'{port_dir}/dev{index}'
+        self.names = [f'{self.dir}/UART{idx}' for idx in range(UART_COUNT)]
+        self.monitor = f'{self.dir}/monitor.sock'
+        # Instances of a fleet each run on a copy, two QEMUs cannot write one image
+        self.snapshots = snapshots if single or snapshots is None else f'{self.dir}/snapshots.qcow2'
+        self.snapshot_base = snapshots
+        self.loadvm = loadvm
+        self.flash = flash
+        if flash is not None and not single:
+            root, ext = os.path.splitext(flash)
+            self.flash = f'{root}.{index}{ext}'
+        self.tcp_ports = [None] * UART_COUNT
+        if serial == 'tcp':
+            self.tcp_ports = list(TCP_PORTS) if single else [free_port() for _ in range(UART_COUNT)]
+        self.gdb_port = None
+        if debug:
+            self.gdb_port = GDB_PORT if single else free_port()
+        self.qemu = None
 
-    [t.join() for t in ts]
+    def command(self):
+        cmd = ['qemu-system-arm', '-M', 'lm3s6965evb', '-nographic', '-kernel', str(self.binary_path),
+               '-monitor', f'unix:{self.monitor},server=on,wait=off']
+        if self.debug:
+            cmd.extend(['-gdb', f'tcp::{self.gdb_port}', '-S'])
+        if self.snapshots is not None:
+            # Attached to nothing, it is only there to keep snapshots in
+            cmd.extend(['-drive', f'if=none,format=qcow2,file={self.snapshots}'])
+        if self.loadvm is not None:
+            cmd.extend(['-loadvm', self.loadvm])
+        if self.flash is not None and os.path.exists(self.flash):
+            cmd.extend(['-device', f'loader,file={self.flash},addr={FLASH_STATE_BASE:#x},force-raw=on'])
+        for idx in range(UART_COUNT):
+            if self.serial == 'tcp':
+                cmd.extend(['-serial', f'tcp:0.0.0.0:{self.tcp_ports[idx]},server'])
+            elif self.serial == 'pty':
+                cmd.extend(['-serial', 'pty'])
+            else:
+                cmd.extend(['-serial', f'unix:{self.names[idx]}.sock,server=on,wait=off'])
+        return cmd
+
+    def start(self, relay):
+        """
+        Starts QEMU and waits until its UARTs are where they are said to be
+        """
+        os.makedirs(self.dir, exist_ok=True)
+        if self.snapshots is not None:
+            if not os.path.exists(self.snapshot_base):
+                subprocess.check_call(['qemu-img', 'create', '-q', '-f', 'qcow2', self.snapshot_base,
+                                       SNAPSHOT_IMAGE_SIZE])
+            if self.snapshots != self.snapshot_base:
+                shutil.copyfile(self.snapshot_base, self.snapshots)
+        if self.flash is not None and os.path.exists(self.flash) and os.path.getsize(self.flash) != FLASH_STATE_SIZE:
+            raise RuntimeError(f'ERROR: {self.flash} is not a flash image of {FLASH_STATE_SIZE} bytes')
+        if self.serial == 'pty':
+            self.start_pty()
+        else:
+            # Nothing is read from the terminal, several instances could not share it.
+            # Its own session keeps Ctrl-C from stopping QEMU before stop() saved the flash
+            self.qemu = subprocess.Popen(self.command(), stdin=subprocess.DEVNULL, start_new_session=True)
+
+        if self.serial == 'tcp':
+            deadline = time.time() + CONNECT_TIMEOUT
+            for idx in range(UART_COUNT):
+                master, slave = pty.openpty()
+                # Raw, and the slave end stays open here so the master never sees a hangup between clients
+                tty.setraw(slave)
+                sock = connect_qemu(self.tcp_ports[idx], deadline)
+                relay.add(sock.detach(), master)
+                link_port(os.ttyname(slave), self.names[idx])
+        elif self.serial == 'unix':
+            for name in self.names:
+                print(f'{name}.sock is open')
+
+    def start_pty(self):
+        # QEMU names the ptys it opened on stderr, the rest of stderr is passed on
+        self.qemu = subprocess.Popen(self.command(), stdin=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True,
+                                     start_new_session=True)
+        linked = 0
+        while linked < UART_COUNT:
+            line = self.qemu.stderr.readline()
+            if not line:
+                raise RuntimeError(f'ERROR: QEMU {self.index} exited before opening its ptys')
+            found = PTY_REDIRECT.search(line)
+            if found:
+                link_port(found.group(1), self.names[int(found.group(2))])
+                linked += 1
+            else:
+                sys.stderr.write(line)
+        threading.Thread(target=lambda: sys.stderr.writelines(self.qemu.stderr), daemon=True).start()
+
+    def save_flash(self):
+        """
+        Dumps the flash the bootloader writes into the flash image, and counts its wear
+        """
+        tmp = f'{self.flash}.tmp'
+        monitor = Monitor(self.monitor)
+        try:
+            monitor.pmemsave(FLASH_STATE_BASE, FLASH_STATE_SIZE, tmp)
+        finally:
+            monitor.close()
+
+        old = None
+        if os.path.exists(self.flash):
+            with open(self.flash, 'rb') as fp:
+                old = fp.read()
+        with open(tmp, 'rb') as fp:
+            count_wear(self.flash, old, fp.read())
+        os.replace(tmp, self.flash)
+
+    def stop(self):
+        """
+        Stops QEMU, keeping its flash if asked to, and removes its ports
+        """
+        if self.flash is not None and self.qemu is not None and self.qemu.poll() is None:
+            try:
+                self.save_flash()
+            except (RuntimeError, OSError) as e:
+                print(f'Flash of instance {self.index} not kept: {e}', file=sys.stderr)
+        if self.qemu is not None and self.qemu.poll() is None:
+            self.qemu.terminate()
+            try:
+                self.qemu.wait(STOP_TIMEOUT)
+            except subprocess.TimeoutExpired:
+                self.qemu.kill()
+                self.qemu.wait()
+        copies = [self.snapshots] if self.snapshots not in (None, self.snapshot_base) else []
+        for name in self.names + [f'{name}.sock' for name in self.names] + [self.monitor] + copies:
+            try:
+                os.unlink(name)
+            except FileNotFoundError:
+                pass
+        if not self.single:
+            try:
+                os.rmdir(self.dir)
+            except OSError:
+                pass
+
+    def describe(self):
+        uarts = []
+        for idx, name in enumerate(self.names):
+            path = f'{name}.sock' if self.serial == 'unix' else name
+            uarts.append({'name': f'UART{idx}', 'path': path, 'tcp': self.tcp_ports[idx]})
+        host = uarts[1]['path']
+        return {
+            'index': self.index,
+            'pid': self.qemu.pid,
+            'dir': self.dir,
+            'monitor': self.monitor,
+            'gdb': self.gdb_port,
+            'snapshots': self.snapshots,
+            'flash': self.flash,
+            'host': f'unix:{host}' if self.serial == 'unix' else host,
+            'uarts': uarts,
+        }
+
+
+def write_inventory(path, instances):
+    """
+    Writes the inventory in one go, so whoever waits for it never reads half of it
+    """
+    tmp = f'{path}.tmp'
+    with open(tmp, 'w') as fp:
+        json.dump({'instances': [i.describe() for i in instances]}, fp, indent=1)
+    os.replace(tmp, path)
+
+
+def emulate(binary_path, debug=False, serial='tcp', instances=1, port_dir=PORT_DIR, inventory=None, snapshots=None,
+            loadvm=None, flash=None):
+    # Stop cleanly when asked to, like on Ctrl-C
+    signal.signal(signal.SIGTERM, lambda signum, frame: sys.exit(0))
+
+    relay = Relay()
+    devices = []
+    try:
+        for index in range(instances):
+            devices.append(Instance(index, binary_path, port_dir, serial, debug, single=instances == 1,
+                                    snapshots=snapshots, loadvm=loadvm, flash=flash))
+            devices[-1].start(relay)
+        if inventory is not None:
+            write_inventory(inventory, devices)
+
+        # Runs until every QEMU closed its ports, there is nothing to relay with pty and unix
+        relay.run()
+        for device in devices:
+            device.qemu.wait()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        for device in devices:
+            device.stop()
+        if inventory is not None and os.path.exists(inventory):
+            os.unlink(inventory)
 
 
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description='Stellaris Emulator')
     parser.add_argument("--boot-path", help="Path to the the bootloader binary.", default=None)
     parser.add_argument("--debug", help="Start GDB server and break on first instruction", action='store_true')
+    parser.add_argument("--serial", help="How the UARTs are exposed: relayed from QEMU's TCP ports, "
+                        "or QEMU's own ptys or unix sockets.", choices=['tcp', 'pty', 'unix'], default='tcp')
+    parser.add_argument("--instances", help="Number of devices to emulate side by side.", type=int, default=1)
+    parser.add_argument("--port-dir", help="Where the UARTs go, in a dev<N> directory each with several instances.",
+                        default=PORT_DIR)
+    parser.add_argument("--inventory", help="JSON file to list the instances in once they are up.", default=None)
+    parser.add_argument("--snapshots", help="qcow2 image to keep snapshots in, made if missing.", default=None)
+    parser.add_argument("--loadvm", help="Snapshot to start in instead of booting.", default=None)
+    parser.add_argument("--flash", help="Image to keep the written flash in from one run to the next.", default=None)
+    parser.add_argument("--save", help="Save a running instance as a snapshot, and exit.", metavar='NAME', default=None)
+    parser.add_argument("--restore", help="Restore a running instance to a snapshot, and exit.", metavar='NAME',
+                        default=None)
+    parser.add_argument("--list-snapshots", help="List the snapshots of a running instance, and exit.",
+                        action='store_true')
+    parser.add_argument("--dump-flash", help="Dump the written flash of a running instance to a file, and exit.",
+                        metavar='FILE', default=None)
+    parser.add_argument("--monitor", help="Monitor of the instance for --save, --restore, --list-snapshots and "
+                        "--dump-flash.", default=f'{PORT_DIR}/monitor.sock')
     args = parser.parse_args()
+    if args.instances < 1:
+        parser.error("--instances has to be at least 1")
+    if args.loadvm is not None and args.snapshots is None:
+        parser.error("--loadvm needs --snapshots")
+
+    if args.save is not None or args.restore is not None or args.list_snapshots or args.dump_flash is not None:
+        monitor = Monitor(args.monitor)
+        if args.save is not None:
+            monitor.savevm(args.save)
+        if args.restore is not None:
+            monitor.loadvm(args.restore)
+        if args.list_snapshots:
+            print('\n'.join(monitor.snapshots()))
+        if args.dump_flash is not None:
+            monitor.pmemsave(FLASH_STATE_BASE, FLASH_STATE_SIZE, args.dump_flash)
+        monitor.close()
+        sys.exit(0)
     if args.boot_path is None:
         binary_path = pathlib.Path(__file__).parent / '..' / 'bootloader' / 'gcc' / 'main.axf'
     else:
         binary_path = pathlib.Path(args.boot_path)
 
-    emulate(binary_path.resolve(), debug=args.debug)
+    emulate(binary_path.resolve(), debug=args.debug, serial=args.serial, instances=args.instances,
+            port_dir=args.port_dir, inventory=args.inventory,
+            snapshots=os.path.abspath(args.snapshots) if args.snapshots else None, loadvm=args.loadvm,
+            flash=os.path.abspath(args.flash) if args.flash else None)
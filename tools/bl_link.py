@@ -0,0 +1,247 @@
+#!/usr/bin/env python
+"""
+Serial Link Emulator
+
+Sits between the host and a device port and makes the line between them
+behave like a real one. The host opens the pty this makes (/embsec/UART1.link
+by default), the device side is a serial port or pty (/embsec/UART1 from
+bl_emulate.py, or a board) or tcp:host:port or unix:path.
+
+Both directions get the same line:
+
+--baud       bytes go out no faster than 8N1 at this rate, 10 bits a byte
+--latency    ms every byte takes on top of that
+--jitter     ms of extra random latency, bytes still arrive in order
+--flip-rate  chance of every bit to arrive flipped
+--drop-rate  chance of every byte to be lost
+
+The emulated UARTs are otherwise infinitely fast and never lose a bit. Here
+a frame takes as long as it would at 115200, and an error costs the full
+send_err() restart it costs on a board. The bytes, flips and drops of
+each direction are printed on exit. The line stays at --baud whatever rate
+the two ends negotiate.
+"""
+
+import argparse
+import collections
+import math
+import os
+import pty
+import random
+import selectors
+import signal
+import socket
+import sys
+import time
+import tty
+
+HOST_PORT = '/embsec/UART1.link'
+# 8 data bits, a start and a stop bit
+BITS_PER_BYTE = 10
+# Bytes are paced in slices this big, so a frame trickles in like it does on a line
+LINK_SLICE = 16
+LINK_CHUNK = 1 << 16
+
+
+def open_device(endpoint):
+    """
+    Opens the device side, given as tcp:host:port, unix:path or the path of a serial port.
+    Return:
+        Its file descriptor
+    """
+    if endpoint.startswith('tcp:'):
+        host, port = endpoint[4:].rsplit(':', 1)
+        sock = socket.create_connection((host, int(port)))
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        return sock.detach()
+    if endpoint.startswith('unix:'):
+        sock = socket.socket(socket.AF_UNIX)
+        sock.connect(endpoint[5:])
+        return sock.detach()
+    fd = os.open(endpoint, os.O_RDWR | os.O_NOCTTY)
+    tty.setraw(fd)
+    return fd
+
+
+class Errors:
+    """
+    Picks where the next error is, for events that each happen with a rate.
+    Skipping ahead geometrically costs one random number per error, not one per bit
+    """
+    def __init__(self, rate, rng):
+        self.rate = rate
+        self.rng = rng
+        self.left = self.skip()
+
+    def skip(self):
+        if self.rate <= 0:
+            return math.inf
+        if self.rate >= 1:
+            return 0
+        return int(math.log(1.0 - self.rng.random()) / math.log(1.0 - self.rate))
+
+    def positions(self, count):
+        """
+        Return:
+            Which of the next count events are errors
+        """
+        found = []
+        at = self.left
+        while at < count:
+            found.append(at)
+            at += 1 + self.skip()
+        self.left = at - count
+        return found
+
+
+class Direction:
+    """
+    One way of the line: what is on it and when each slice of it arrives
+    """
+    def __init__(self, name, args, rng):
+        self.name = name
+        self.byte_time = BITS_PER_BYTE / args.baud if args.baud else 0
+        self.latency = args.latency / 1000
+        self.jitter = args.jitter / 1000
+        self.rng = rng
+        self.flips = Errors(args.flip_rate, rng)
+        self.drops = Errors(args.drop_rate, rng)
+        # When the line is free to send the next byte, and when the last slice arrives
+        self.line_free = 0.0
+        self.last_arrival = 0.0
+        self.queue = collections.deque()
+        self.sent = 0
+        self.flipped = 0
+        self.dropped = 0
+
+    def push(self, data, now):
+        """
+        Puts bytes on the line, with errors, as they come in
+        """
+        data = bytearray(data)
+        flipped = self.flips.positions(len(data) * 8)
+        for bit in flipped:
+            data[bit // 8] ^= 1 << (bit % 8)
+        self.flipped += len(flipped)
+        dropped = set(self.drops.positions(len(data)))
+        if dropped:
+            data = bytearray(b for i, b in enumerate(data) if i not in dropped)
+        self.dropped += len(dropped)
+
+        for i in range(0, len(data), LINK_SLICE):
+            piece = data[i:i + LINK_SLICE]
+            self.line_free = max(self.line_free, now) + len(piece) * self.byte_time
+            arrival = self.line_free + self.latency + self.rng.uniform(0, self.jitter)
+            # A UART does not reorder, jitter only ever holds bytes back
+            self.last_arrival = max(self.last_arrival, arrival)
+            self.queue.append((self.last_arrival, bytes(piece)))
+
+    def due(self, now):
+        """
+        Return:
+            Every slice that has arrived by now
+        """
+        out = bytearray()
+        while self.queue and self.queue[0][0] <= now:
+            out += self.queue.popleft()[1]
+        self.sent += len(out)
+        return bytes(out)
+
+    def next_arrival(self):
+        return self.queue[0][0] if self.queue else None
+
+
+class Link:
+    """
+    Runs both directions between the host pty and the device from one selector
+    """
+    def __init__(self, host, device, args):
+        rng = random.Random(args.seed)
+        self.ends = {host: device, device: host}
+        self.lines = {host: Direction('to device', args, rng), device: Direction('to host', args, rng)}
+        self.pending = {host: bytearray(), device: bytearray()}
+        self.sel = selectors.DefaultSelector()
+        for fd in self.ends:
+            os.set_blocking(fd, False)
+            self.sel.register(fd, selectors.EVENT_READ)
+
+    def write(self, fd, data):
+        pending = self.pending[fd]
+        pending += data
+        try:
+            del pending[:os.write(fd, pending)]
+        except BlockingIOError:
+            pass
+        self.sel.modify(fd, selectors.EVENT_READ | (selectors.EVENT_WRITE if pending else 0))
+
+    def run(self):
+        """
+        Carries bytes until the device side closes
+        """
+        while True:
+            now = time.monotonic()
+            arrivals = [a for a in (line.next_arrival() for line in self.lines.values()) if a is not None]
+            timeout = max(0.0, min(arrivals) - now) if arrivals else None
+
+            for key, events in self.sel.select(timeout):
+                fd = key.fd
+                if events & selectors.EVENT_WRITE:
+                    self.write(fd, b'')
+                if events & selectors.EVENT_READ:
+                    try:
+                        data = os.read(fd, LINK_CHUNK)
+                    except BlockingIOError:
+                        continue
+                    except OSError:
+                        data = b''
+                    if not data:
+                        return
+                    self.lines[fd].push(data, time.monotonic())
+
+            now = time.monotonic()
+            for fd, line in self.lines.items():
+                data = line.due(now)
+                if data:
+                    self.write(self.ends[fd], data)
+
+    def report(self):
+        for line in self.lines.values():
+            print(f'{line.name}: {line.sent} bytes, {line.flipped} bits flipped, {line.dropped} bytes dropped')
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Serial Link Emulator')
+    parser.add_argument("--device", help="Device side, a serial port, tcp:host:port or unix:path.",
+                        default='/embsec/UART1')
+    parser.add_argument("--port", help="Where the host side pty is linked.", default=HOST_PORT)
+    parser.add_argument("--baud", help="Line rate in baud, 0 for no limit.", type=int, default=115200)
+    parser.add_argument("--latency", help="Latency of every byte in ms.", type=float, default=0)
+    parser.add_argument("--jitter", help="Random extra latency of up to this many ms.", type=float, default=0)
+    parser.add_argument("--flip-rate", help="Chance of every bit to be flipped.", type=float, default=0)
+    parser.add_argument("--drop-rate", help="Chance of every byte to be lost.", type=float, default=0)
+    parser.add_argument("--seed", help="Seed of the errors and jitter, for runs that repeat.", type=int, default=None)
+    args = parser.parse_args()
+    for rate in (args.flip_rate, args.drop_rate):
+        if not 0 <= rate <= 1:
+            parser.error("rates are chances, between 0 and 1")
+
+    device = open_device(args.device)
+    master, slave = pty.openpty()
+    # Raw, and the slave end stays open here so the master never sees a hangup between clients
+    tty.setraw(slave)
+    try:
+        os.unlink(args.port)
+    except FileNotFoundError:
+        pass
+    os.symlink(os.ttyname(slave), args.port)
+    print(f'{args.port} is open')
+
+    signal.signal(signal.SIGTERM, lambda signum, frame: sys.exit(0))
+    link = Link(master, device, args)
+    try:
+        link.run()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        link.report()
+        os.unlink(args.port)
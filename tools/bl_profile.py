@@ -0,0 +1,83 @@
+#!/usr/bin/env python
+"""
+Bootloader Profile Tool
+
+Reads the per-phase cycle counts of a bootloader built with make PROFILE=1.
+'P' is sent over the host port, the bootloader answers 'P' there and writes
+the table over its debug port (UART2):
+
+[ 0x04 ][ 0x01 ][ 0x04 ] then per phase [ 0x04 ][ 0x04 ][ 0x04 ][ 0x08 ]
+---------------------------------------------------------------------
+| PROF | Phases | Clock |               | Count | Min  | Max  | Sum  |
+---------------------------------------------------------------------
+
+All little endian. The table covers every update since the last dump, the
+dump clears it. Phases are the PROF_* constants of bootloader/src/profile.h.
+"""
+
+import argparse
+import struct
+
+from serial import Serial
+
+MAGIC = b'PROF'
+BAUD_DEFAULT = 115200
+
+# Same order as profile.h
+PHASES = ['handshake', 'frame_rx', 'frame_hmac', 'gcm', 'image_mac', 'big_mac',
+          'flash_erase', 'flash_program', 'release_write']
+ENTRY = struct.Struct('<IIIQ')
+
+
+def read_dump(host, debug):
+    """
+    Asks for the table and reads it back.
+    Return:
+        clock: Core clock in Hz
+        entries: (count, min, max, sum) per phase
+    """
+    debug.reset_input_buffer()
+    host.write(b'P')
+    if host.read(1) != b'P':
+        raise RuntimeError('Bootloader did not answer P, is it built with PROFILE=1?')
+
+    # Debug text may come before the dump, skip to the magic
+    seen = b''
+    while not seen.endswith(MAGIC):
+        b = debug.read(1)
+        if not b:
+            raise RuntimeError('No profile dump on the debug port')
+        seen = seen[-len(MAGIC):] + b
+
+    phases = debug.read(1)[0]
+    clock, = struct.unpack('<I', debug.read(4))
+    raw = debug.read(phases * ENTRY.size)
+    if len(raw) != phases * ENTRY.size:
+        raise RuntimeError('Profile dump cut short')
+    return clock, [ENTRY.unpack_from(raw, i * ENTRY.size) for i in range(phases)]
+
+
+def print_dump(clock, entries):
+    """
+    Prints the table, times in microseconds at the given clock
+    """
+    us = lambda cycles: cycles * 1e6 / clock if clock else 0
+    print(f'{"phase":<14}{"count":>7}{"min us":>11}{"avg us":>11}{"max us":>11}{"total ms":>11}')
+    for i, (count, lo, hi, total) in enumerate(entries):
+        name = PHASES[i] if i < len(PHASES) else f'phase{i}'
+        if not count:
+            print(f'{name:<14}{0:>7}')
+            continue
+        print(f'{name:<14}{count:>7}{us(lo):>11.1f}{us(total / count):>11.1f}{us(hi):>11.1f}{us(total) / 1000:>11.2f}')
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Bootloader Profile Tool')
+
+    parser.add_argument("--port", help="Serial port the bootloader takes commands on (UART1).", required=True)
+    parser.add_argument("--debug-port", help="Serial port of the bootloader's debug output (UART2).", required=True)
+    args = parser.parse_args()
+
+    host = Serial(args.port, baudrate=BAUD_DEFAULT, timeout=2)
+    debug = Serial(args.debug_port, baudrate=BAUD_DEFAULT, timeout=2)
+    print_dump(*read_dump(host, debug))
@@ -0,0 +1,315 @@
+#!/usr/bin/env python
+"""
+Fleet Update Tool
+
+Sends one protected blob to many bootloaders at once from a single asyncio
+event loop. The blob is read and split into its parts once (fw_update.Blob,
+views that every device shares without copying), and every device
+then gets its own state machine over the same protocol fw_update.py speaks:
+
+START -> HEADER -> [MANIFEST] -> FRAMES -> FINISH -> DONE
+
+Updates always start with 'J', so a device that failed part way is resumed
+from the first frame it still needs, up to --retries times with a growing
+pause in between (the bootloader resets itself on every error, and a
+device still waiting on lost bytes is made to fail first). A link that
+drops is opened again for the next attempt. A device that is still
+failing after that is marked FAILED, the others carry on.
+
+Devices are serial ports (/dev/ttyUSB0, /embsec/UART1) or emulator
+endpoints (tcp:localhost:13338, or unix:/embsec/UART1.sock from
+bl_emulate.py --serial unix). --inventory takes every device from the
+inventory of bl_emulate.py --instances N.
+Baud rate negotiation is left out, every device stays at 115200.
+
+At the end every device is listed with its state, attempts, time and
+throughput, followed by the time the whole fleet took.
+"""
+
+import argparse
+import asyncio
+import json
+import os
+import struct
+import termios
+import time
+
+from fw_update import RESP_OK, ACK_INDEX_SIZE, RESET_SETTLE, FLUSH_SIZE, Blob
+
+# How long a device has to answer anything before the attempt is given up
+DEFAULT_TIMEOUT = 5.0
+
+
+async def open_link(endpoint):
+    """
+    Opens a device given as tcp:host:port, unix:path or as the path of a serial port.
+    Return:
+        StreamReader and StreamWriter of the link
+    """
+    if endpoint.startswith('tcp:'):
+        host, port = endpoint[4:].rsplit(':', 1)
+        return await asyncio.open_connection(host, int(port))
+    if endpoint.startswith('unix:'):
+        return await asyncio.open_unix_connection(endpoint[5:])
+
+    # Raw 115200 8N1, the event loop takes character devices like pipes
+    fd = os.open(endpoint, os.O_RDWR | os.O_NOCTTY | os.O_NONBLOCK)
+    attrs = termios.tcgetattr(fd)
+    attrs[0] = 0                                                 # iflag
+    attrs[1] = 0                                                 # oflag
+    attrs[2] = termios.CS8 | termios.CREAD | termios.CLOCAL      # cflag
+    attrs[3] = 0                                                 # lflag
+    attrs[4] = attrs[5] = termios.B115200
+    attrs[6][termios.VMIN] = 0
+    attrs[6][termios.VTIME] = 0
+    termios.tcsetattr(fd, termios.TCSANOW, attrs)
+
+    loop = asyncio.get_running_loop()
+    reader = asyncio.StreamReader()
+    rx = open(fd, 'rb', buffering=0, closefd=False)
+    tx = open(fd, 'wb', buffering=0)
+    await loop.connect_read_pipe(lambda: asyncio.StreamReaderProtocol(reader), rx)
+    transport, protocol = await loop.connect_write_pipe(lambda: asyncio.StreamReaderProtocol(asyncio.StreamReader()), tx)
+    return reader, asyncio.StreamWriter(transport, protocol, reader, loop)
+
+
+class Device:
+    """
+    One bootloader being updated, and what became of it
+    """
+    def __init__(self, endpoint, blob, window, retries, timeout):
+        self.endpoint = endpoint
+        self.blob = blob
+        self.window = window
+        self.retries = retries
+        self.timeout = timeout
+        self.state = 'START'
+        self.attempts = 0
+        self.bytes_sent = 0
+        self.error = None
+        self.elapsed = 0.0
+        self.reader = self.writer = None
+
+    async def connect(self):
+        try:
+            self.reader, self.writer = await asyncio.wait_for(open_link(self.endpoint), self.timeout)
+        except (OSError, asyncio.TimeoutError) as e:
+            raise RuntimeError(f"cannot open: {e}")
+
+    def disconnect(self):
+        if self.writer is not None:
+            self.writer.close()
+            self.reader = self.writer = None
+
+    async def read(self, n):
+        try:
+            return await asyncio.wait_for(self.reader.readexactly(n), self.timeout)
+        except asyncio.IncompleteReadError:
+            raise RuntimeError(f"link closed in {self.state}")
+        except asyncio.TimeoutError:
+            raise RuntimeError(f"timed out in {self.state}")
+
+    async def send(self, data):
+        self.writer.write(data)
+        self.bytes_sent += len(data)
+        await self.writer.drain()
+
+    async def drain(self):
+        """
+        Throws away whatever the device sent before it reset
+        """
+        while True:
+            try:
+                if not await asyncio.wait_for(self.reader.read(1024), 0.1):
+                    return
+            except asyncio.TimeoutError:
+                return
+
+    async def expect_ok(self):
+        resp = await self.read(1)
+        if resp != RESP_OK:
+            raise RuntimeError(f"bootloader responded with {resp!r} in {self.state}")
+
+    async def wait_ack(self, in_flight):
+        """
+        Waits for one frame ack, cumulative and with its index when windowed
+        """
+        await self.expect_ok()
+        if self.window == 1:
+            in_flight.pop(0)
+            return
+        acked, = struct.unpack("<H", await self.read(ACK_INDEX_SIZE))
+        if acked not in in_flight:
+            raise RuntimeError(f"bootloader acked frame {acked}, expected {in_flight[0]}")
+        while in_flight and in_flight[0] <= acked:
+            in_flight.pop(0)
+
+    async def attempt(self):
+        """
+        Runs through the update once, resuming wherever the device left off
+        """
+        blob = self.blob
+
+        self.state = 'START'
+        await self.send(b'J' + struct.pack("<B", min(self.window, 0xFF)))
+        while await self.read(1) != b'J':
+            pass
+        self.window, = await self.read(1)
+
+        self.state = 'HEADER'
+        await self.send(blob.header)
+        await self.expect_ok()
+        first, = struct.unpack("<H", await self.read(ACK_INDEX_SIZE))
+        if first > blob.page_number:
+            raise RuntimeError(f"bootloader asked to resume from frame {first} of {blob.page_number}")
+
+        needed = None
+        if blob.manifest is not None:
+            self.state = 'MANIFEST'
+            await self.send(blob.manifest)
+            await self.expect_ok()
+            bitmap = await self.read((blob.page_number + 7) // 8)
+            needed = {i for i in range(blob.page_number) if bitmap[i // 8] >> (i % 8) & 1}
+
+        self.state = 'FRAMES'
+        in_flight = []
+        for i in range(first, blob.page_number):
+            if needed is not None and i not in needed:
+                continue
+            if len(in_flight) == self.window:
+                await self.wait_ack(in_flight)
+            await self.send(blob.frames[i])
+            in_flight.append(i)
+        while in_flight:
+            await self.wait_ack(in_flight)
+
+        self.state = 'FINISH'
+        for part in (blob.image_mac, blob.release, blob.big_mac):
+            await self.send(part)
+            await self.expect_ok()
+        self.state = 'DONE'
+
+    async def run(self):
+        """
+        Updates the device, resuming after failures as the retry policy allows
+        """
+        started = time.perf_counter()
+        try:
+            await self.connect()
+        except RuntimeError as e:
+            self.state, self.error = 'FAILED', str(e)
+            return self
+
+        try:
+            while True:
+                self.attempts += 1
+                try:
+                    # A link that failed is opened again
+                    if self.writer is None:
+                        await self.connect()
+                    await self.attempt()
+                    break
+                except RuntimeError as e:
+                    self.error = str(e)
+                except OSError as e:
+                    self.error = f"link failed in {self.state}: {e}"
+                    self.disconnect()
+                if self.attempts > self.retries:
+                    self.state = 'FAILED'
+                    break
+                try:
+                    await self.recover()
+                except OSError:
+                    self.disconnect()
+        finally:
+            self.elapsed = time.perf_counter() - started
+            self.disconnect()
+        return self
+
+    async def recover(self):
+        """
+        Gets the device back to waiting for a command before the next attempt
+        """
+        if self.writer is not None:
+            # A device that lost a byte is still reading a frame, the zeros
+            # complete it so it fails like the rest, as fw_update.recover() does
+            self.writer.write(bytes(FLUSH_SIZE))
+            await self.writer.drain()
+        # The bootloader resets on errors, give it longer every time
+        await asyncio.sleep(RESET_SETTLE * self.attempts)
+        if self.writer is not None:
+            await self.drain()
+
+    def report(self):
+        return {
+            'endpoint': self.endpoint,
+            'state': self.state,
+            'attempts': self.attempts,
+            'seconds': round(self.elapsed, 3),
+            'bytes_sent': self.bytes_sent,
+            'bytes_per_second': round(self.bytes_sent / self.elapsed) if self.elapsed else 0,
+            'error': self.error if self.state != 'DONE' else None,
+        }
+
+
+async def update_fleet(endpoints, blob, window=1, retries=2, timeout=DEFAULT_TIMEOUT):
+    """
+    Updates every endpoint concurrently.
+    Return:
+        Report of every device, and the seconds until the last one finished
+    """
+    started = time.perf_counter()
+    devices = [Device(e, blob, window, retries, timeout) for e in endpoints]
+    # Anything a device did not handle fails only that device
+    results = await asyncio.gather(*(d.run() for d in devices), return_exceptions=True)
+    for device, result in zip(devices, results):
+        if isinstance(result, Exception):
+            device.state, device.error = 'FAILED', f"{type(result).__name__}: {result}"
+    return [d.report() for d in devices], time.perf_counter() - started
+
+
+def print_report(reports, total):
+    """
+    Prints one line per device and the fleet totals
+    """
+    print(f'{"device":<28}{"state":<10}{"tries":>6}{"seconds":>9}{"bytes/s":>9}  error')
+    for r in reports:
+        print(f'{r["endpoint"]:<28}{r["state"]:<10}{r["attempts"]:>6}{r["seconds"]:>9.2f}'
+              f'{r["bytes_per_second"]:>9}  {r["error"] or ""}')
+    done = sum(r['state'] == 'DONE' for r in reports)
+    print(f'{done} of {len(reports)} devices updated in {total:.2f} s')
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Fleet Update Tool')
+    parser.add_argument("--firmware", help="Path to the protected firmware blob.", required=True)
+    parser.add_argument("--port", help="Device to update, a serial port, tcp:host:port or unix:path. Repeat for more.",
+                        action='append', default=[])
+    parser.add_argument("--ports-file", help="File with one device per line.", default=None)
+    parser.add_argument("--inventory", help="Inventory of bl_emulate.py to update every instance of.", default=None)
+    parser.add_argument("--window", help="Number of frames to keep in flight per device.", type=int, default=1)
+    parser.add_argument("--retries", help="Times a device is resumed after a failure.", type=int, default=2)
+    parser.add_argument("--timeout", help="Seconds a device may stay silent.", type=float, default=DEFAULT_TIMEOUT)
+    parser.add_argument("--json", help="Print the report as JSON.", action='store_true')
+    args = parser.parse_args()
+
+    endpoints = list(args.port)
+    if args.ports_file:
+        with open(args.ports_file) as fp:
+            endpoints += [line.strip() for line in fp if line.strip() and not line.startswith('#')]
+    if args.inventory:
+        with open(args.inventory) as fp:
+            endpoints += [instance['host'] for instance in json.load(fp)['instances']]
+    if not endpoints:
+        parser.error("no devices, give --port, --ports-file or --inventory")
+
+    with open(args.firmware, 'rb') as fp:
+        blob = Blob(fp.read())
+
+    reports, total = asyncio.run(update_fleet(endpoints, blob, args.window, args.retries, args.timeout))
+    if args.json:
+        print(json.dumps({'devices': reports, 'seconds': round(total, 3)}, indent=1))
+    else:
+        print_report(reports, total)
+    if any(r['state'] != 'DONE' for r in reports):
+        raise SystemExit(1)
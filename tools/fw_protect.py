@@ -2,76 +2,326 @@
 """
 Firmware Bundle-and-Protect Tool
 
-This tool receives the new firmware and encrypts it with AES128-GCM along with metadata,
-creates frames and builds hmacs.
+This tool receives the new firmware, splits it into frames and encrypts each frame
+on its own with AES128-GCM (STREAM construction), along with metadata and hmacs.
+Every frame can be authenticated and decrypted as soon as it arrives.
 A blob of all of the data is created, which is sent to fw_update.py
+
+With --batch, many images are protected in parallel from a JSON manifest,
+a list of objects with the same fields as the command line:
+
+[{"infile": "fw_v3.bin", "outfile": "fw_v3.prot", "version": 3, "message": "v3",
+  "base": null, "base_version": 0, "compress": false, "skip_unchanged": false}, ...]
+
+Paths are relative to the manifest. The keys are read once, and an index of
+every blob (encoding, sizes, frame count and SHA-256 digests) is written
+next to the manifest.
+
+With --infile - and --outfile - the image is read from stdin and the blob
+written to stdout, to sit in a build pipeline. The whole image is read
+before anything is written, the header carries its size.
 """
 import argparse
+import bisect
+import concurrent.futures
+import hashlib
+import hmac
+import json
+import os
 import struct
+import sys
 
 from math import *
 
 from Crypto.Cipher import AES
 from Crypto.Random import get_random_bytes
 
-from Crypto.Hash import HMAC, SHA256
+# Random part of every frame's AES-GCM nonce
+NONCE_PREFIX_SIZE = 7
+
+# Page size of the bootloader's flash
+PG_SIZE = 1024
+
+HEADER_SIZE = 18
+HMAC_SIZE = 32
+TAG_SIZE = 16
+# Page metadata, its hmac, the page's hmac and its GCM tag around every page
+FRAME_OVERHEAD = 6 + HMAC_SIZE + HMAC_SIZE + TAG_SIZE
+
+# How the frames carry the firmware
+ENC_RAW = 0
+ENC_DELTA = 1
+ENC_LZ = 2
+ENC_PAGES = 3
+ENC_NAMES = {ENC_RAW: 'raw', ENC_DELTA: 'delta', ENC_LZ: 'lz', ENC_PAGES: 'pages'}
+
+# Written by bl_build.py, aes key and hmac key in hex on a line each
+KEY_FILE = "./secret_build_output.txt"
+
+# Patch ops, see patch_feed() in bootloader.c
+PATCH_COPY = 0x01
+PATCH_ADD = 0x02
+# Shortest copy worth its 5 byte op
+PATCH_MIN_COPY = 8
+# Candidate matches tried per position
+PATCH_CANDIDATES = 64
+# Longest run a 2 byte length can describe
+PATCH_MAX_RUN = 0xFFFF
+
+# LZSS, see lz_feed() in bootloader.c. Matches reach back at most one page
+LZ_WINDOW = PG_SIZE
+LZ_OFFSET_BITS = 10
+LZ_MIN_MATCH = 3
+LZ_MAX_MATCH = LZ_MIN_MATCH + (1 << (16 - LZ_OFFSET_BITS)) - 1
+# Candidate matches tried per position
+LZ_CANDIDATES = 32
 
 
-def protect_firmware(infile, outfile, version, message):
+def make_patch(base, firmware):
     """
-    Creates metadata, hashes, and encrypts firmware
+    Creates a patch that turns base (the installed firmware) into firmware.
+    The bootloader replaces pages in order while it applies the patch, so a copy
+    into a page may only read the old image from the start of that page onwards.
+    Return:
+        The patch as bytes
     """
+    # Positions of every 4 byte sequence in base
+    index = {}
+    for s in range(len(base) - 3):
+        index.setdefault(base[s:s+4], []).append(s)
     
-    # Load firmware binary from infile
-    with open(infile, 'rb') as fp:
-        firmware = fp.read()
+    patch = bytearray()
+    literal = bytearray()
+    
+    def flush_literal():
+        for i in range(0, len(literal), PATCH_MAX_RUN):
+            run = literal[i:i+PATCH_MAX_RUN]
+            patch.extend(struct.pack('<BH', PATCH_ADD, len(run)) + run)
+        literal.clear()
+    
+    o = 0
+    while o < len(firmware):
+        page_start = o - o % PG_SIZE
+        page_end = page_start + PG_SIZE
         
-    # Read aes key and hmac key from ./secret_build_output.txt
-    with open("./secret_build_output.txt", 'rb') as f:
+        best_len, best_src = 0, 0
+        positions = index.get(firmware[o:o+4], [])
+        first = bisect.bisect_left(positions, page_start)
+        for s in positions[first:first + PATCH_CANDIDATES]:
+            # Reading behind the output is only safe until the output reaches the next page
+            limit = len(firmware) - o if s >= o else min(len(firmware), page_end) - o
+            limit = min(limit, len(base) - s, PATCH_MAX_RUN)
+            n = 0
+            while n < limit and firmware[o + n] == base[s + n]:
+                n += 1
+            if n > best_len:
+                best_len, best_src = n, s
+        
+        if best_len >= PATCH_MIN_COPY:
+            flush_literal()
+            patch.extend(struct.pack('<BHH', PATCH_COPY, best_src, best_len))
+            o += best_len
+        else:
+            literal.append(firmware[o])
+            o += 1
+    
+    flush_literal()
+    return bytes(patch)
+
+
+def lz_compress(firmware):
+    """
+    Compresses firmware with LZSS. Each flag byte describes the next 8 items, LSB first:
+    1 is a literal byte, 0 is a 2 byte match token of 10 bits offset - 1 and 6 bits length - 3.
+    Return:
+        The compressed firmware as bytes
+    """
+    # Most recent positions of every 3 byte sequence seen so far
+    index = {}
+    out = bytearray()
+    flags_at = 0
+    items = 8
+    
+    o = 0
+    while o < len(firmware):
+        if items == 8:
+            flags_at = len(out)
+            out.append(0)
+            items = 0
+        
+        best_len, best_off = 0, 0
+        key = firmware[o:o+3]
+        positions = index.get(key, [])
+        limit = min(LZ_MAX_MATCH, len(firmware) - o)
+        for s in reversed(positions[-LZ_CANDIDATES:]):
+            if o - s > LZ_WINDOW:
+                break
+            n = 0
+            while n < limit and firmware[s + n] == firmware[o + n]:
+                n += 1
+            if n > best_len:
+                best_len, best_off = n, o - s
+                if n == limit:
+                    break
+        
+        if best_len >= LZ_MIN_MATCH:
+            token = (best_off - 1) | (best_len - LZ_MIN_MATCH) << LZ_OFFSET_BITS
+            out.extend(struct.pack('<H', token))
+            step = best_len
+        else:
+            out[flags_at] |= 1 << items
+            out.append(firmware[o])
+            step = 1
+        items += 1
+        
+        for p in range(o, o + step):
+            if p + 3 <= len(firmware):
+                index.setdefault(firmware[p:p+3], []).append(p)
+        o += step
+    
+    return bytes(out)
+
+
+def mac(key, data):
+    """
+    HMAC-SHA256 in one call, which lets go of the GIL while it hashes
+    Return:
+        32 byte mac
+    """
+    return hmac.digest(key, data, 'sha256')
+
+
+def load_keys(path=KEY_FILE):
+    """
+    Reads the keys bl_build.py made.
+    Return:
+        aes key and hmac key
+    """
+    with open(path, 'rb') as f:
         aes_key = bytes.fromhex(f.readline().decode())
         hmackey = bytes.fromhex(f.readline().decode())
+    return aes_key, hmackey
+
+
+def protect_firmware(infile, outfile, version, message, base=None, base_version=0, compress=False,
+                     skip_unchanged=False, keys=None, threads=None, firmware=None):
+    """
+    Creates metadata, hashes, and encrypts firmware
+    If base (the firmware installed on the device) is given, a patch against it is sent instead
+    when that is smaller. It only applies on top of base_version.
+    If compress is set, the firmware is sent LZSS compressed when that is smaller.
+    If skip_unchanged is set, a manifest of page hmacs is sent first and the bootloader only
+    asks for the pages that differ from what it has in flash.
+    keys are the aes and hmac key, read from KEY_FILE if not given.
+    threads is how many pages are sealed at once, one per CPU by default.
+    An infile or outfile of - is stdin or stdout.
+    firmware is the image itself if the caller already read it, infile is not read then.
+    Return:
+        The blob, in the bytearray it was built in
+    """
+    
+    # Load firmware binary from infile, unless the caller has it already
+    if firmware is None and infile == '-':
+        firmware = sys.stdin.buffer.read()
+    elif firmware is None:
+        with open(infile, 'rb') as fp:
+            firmware = fp.read()
+    
+    # Frames carry the firmware itself, a patch that rebuilds it from base or the
+    # compressed firmware, whichever is smallest
+    encoding = ENC_RAW
+    payload = firmware
+    if compress:
+        packed = lz_compress(firmware)
+        if len(packed) < len(payload):
+            encoding = ENC_LZ
+            payload = packed
+    if base is not None:
+        with open(base, 'rb') as fp:
+            patch = make_patch(fp.read(), firmware)
+        if len(patch) < len(payload):
+            encoding = ENC_DELTA
+            payload = patch
+    if skip_unchanged:
+        encoding = ENC_PAGES
+        payload = firmware
+    if encoding != ENC_DELTA:
+        base_version = 0
+        
+    # Read aes key and hmac key from ./secret_build_output.txt
+    aes_key, hmackey = keys if keys is not None else load_keys()
+    
+    # Every part has a known size, so the blob is allocated once and each part written in place
+    rmessage = message.encode()
+    page_number = ceil(len(payload) / PG_SIZE)
+    manifest_size = page_number * HMAC_SIZE + HMAC_SIZE if encoding == ENC_PAGES else 0
+    frames_at = HEADER_SIZE + HMAC_SIZE + manifest_size
+    release_at = frames_at + len(payload) + page_number * FRAME_OVERHEAD + HMAC_SIZE
+    firmware_blob = bytearray(release_at + len(rmessage) + HMAC_SIZE * 2)
+    blob = memoryview(firmware_blob)
+    payload = memoryview(payload)
     
     
-    # METADATA
+    # HEADER
     """
     This part of the blob creates the metadata of the entire (unencrypted) firmware
+    and the nonce prefix that every frame's AES-GCM nonce starts with
     """
     
-    ##################################################################################################
-    #                        Metadata                              #         Metadata Hash           #
-    ##################################################################################################
-    # 2b version / 2b len of firmaware / 2b len of release message # 32b hmac hash of 6b of metadata #
-    ##################################################################################################
+    ##########################################################################################################
+    #                        Metadata                              #  Nonce Prefix   #    Transfer Info      #
+    ##########################################################################################################
+    # 2b version / 2b len of firmaware / 2b len of release message # 7b random bytes # 1b encoding /         #
+    #                                                              #                 # 2b len of payload /   #
+    #                                                              #                 # 2b base version       #
+    ##########################################################################################################
+    #                                   32b hmac hash of 18b of header                                       #
+    ##########################################################################################################
     
     firmware_size = len(firmware)
-    # Pack version, firmware size, number of frames and release message length into 3 shorts
+    # Pack version, firmware size (uncompressed), number of frames and release message length into 3 shorts
     metadata = struct.pack('<HHH', version, len(firmware), len(message))
-    # Generate hmac hash for the metadata
-    metadata_hash = HMAC.new(hmackey, metadata, digestmod=SHA256).digest()
+    # Random per update, the rest of each nonce is the frame index and a last frame flag
+    nonce_prefix = get_random_bytes(NONCE_PREFIX_SIZE)
+    # Encoding, size of what the frames carry (compressed or patch size) and the version a patch applies to
+    xfer_info = struct.pack('<BHH', encoding, len(payload), base_version)
+    header = metadata + nonce_prefix + xfer_info
+    # Generate hmac hash for the header
+    header_hash = mac(hmackey, header)
 
-    metadata_and_hash = metadata + metadata_hash
+    blob[:HEADER_SIZE + HMAC_SIZE] = header + header_hash
     
     
-    # FIRMWARE ENCRYPTION
+    # PAGE MANIFEST
     """
-    This encrypts the firmware and generates iv + hmac of the entire encrypted firmware
+    Only there with ENC_PAGES. The bootloader compares every entry against an hmac of
+    the page it has in flash, and answers with a bitmap of the pages it needs.
+    Each page is hashed after the nonce prefix and its 2-byte index, so equal pages
+    do not get equal entries, in one manifest or across releases
     """
     
-    # Firmware Metadata
-    firmware_data = b""
-    # Generates 16-byte iv for aes-gcm encryption
-    iv = get_random_bytes(16)
-    # Creates aes-gcm cipher using the aes key in ./secret_build_output.txt
-    gcm_cipher = AES.new(aes_key, AES.MODE_GCM, nonce=iv)
-    # Encrypts entire firmware and generates 16-byte tag using aes128-gcm
-    encrypted_firmware, tag = gcm_cipher.encrypt_and_digest(firmware)
-    # Generates 32-byte HMAC-SHA256 hash of the entire firmware
-    fw_hash_total = HMAC.new(hmackey, encrypted_firmware, digestmod=SHA256).digest()
+    ###############################################################
+    #              Page Hashes              #    Manifest Hash    #
+    ###############################################################
+    # 32b hmac hash of every page of firmware #   32b hmac hash    #
+    ###############################################################
+    
+    if encoding == ENC_PAGES:
+        manifest = blob[HEADER_SIZE + HMAC_SIZE:frames_at - HMAC_SIZE]
+        for i in range(page_number):
+            page_mac = hmac.new(hmackey, nonce_prefix, 'sha256')
+            page_mac.update(struct.pack("<H", i))
+            page_mac.update(payload[i * PG_SIZE:(i + 1) * PG_SIZE])
+            manifest[i * HMAC_SIZE:(i + 1) * HMAC_SIZE] = page_mac.digest()
+        blob[frames_at - HMAC_SIZE:frames_at] = mac(hmackey, manifest)
     
     
     # FIRMWARE FRAMES
     """
-    This part of the blob consists of pages and the metadata of each page, along with hmac hashes
+    This part of the blob consists of pages of the payload (the firmware, a patch or the compressed firmware) and the
+    metadata of each page, along with hmac hashes.
+    Each page is its own AES-GCM message, keyed by the page index, with the page metadata as
+    associated data
     """
     
     ###############################################################################################
@@ -81,9 +331,9 @@ def protect_firmware(infile, outfile, version, message):
     ###############################################################################################
     # 2b page index / 2b size of page / 2b version num #  32b hmac hash of 6b firmware metadata   #
     ###############################################################################################
-    #                  Page/Firmware Data                       #          Page/Data Hash         #
+    #         Encrypted Page Data         #          Page/Data Hash         #    Page GCM Tag     #
     ###############################################################################################
-    # 1024b chunk of the firmware (could be less if last chunk) #    32b hmac hash of page data   #
+    # 1024b chunk (less if last chunk)    #    32b hmac hash of page data   #     16b gcm tag     #
     ###############################################################################################
     
     ####################################################################
@@ -91,35 +341,45 @@ def protect_firmware(infile, outfile, version, message):
     ####################################################################
     #                        Firmware Total Hash                       #
     ####################################################################
-    # 32b hmac hash of the entire encrypted firmware (generated above) #
+    #     32b hmac hash of the entire (decrypted) firmware             #
     ####################################################################
     
-    # Loops through entire encrypted firmware with chunks of max 1024
-    for i in range(0, len(encrypted_firmware), 1024):
-        # If the chunk of firmware is the full size of 1024
-        if (i + 1024 < len(encrypted_firmware)):
-            page = encrypted_firmware[i:i+1024]
-        # If the chunk of firmware (last one) is less than 1024
-        else:
-            page = encrypted_firmware[i:len(encrypted_firmware)]
-        # 2-byte short for the page index (to ensure pages are sent and received in correct order)
-        page_index = struct.pack("<H", ceil(i/1024))
-        # 2-byte short for the page length
-        page_size = struct.pack("<H", len(page))
-        # 2-byte short for the version number (an extra integrity check)
-        version_number = struct.pack("<H", version)
+    def seal_page(page_index):
+        """
+        Encrypts one page and writes its frame in place. Frames do not overlap, so pages
+        are sealed on threads; hashlib and AES let go of the GIL while they work
+        """
+        page = payload[page_index * PG_SIZE:(page_index + 1) * PG_SIZE]
+        at = frames_at + page_index * (PG_SIZE + FRAME_OVERHEAD)
+        # 2-byte shorts for the page index (to ensure pages are sent and received in correct order),
+        # the page length and the version number (an extra integrity check)
+        page_metadata = struct.pack("<HHH", page_index, len(page), version)
         
-        page_metadata = page_index + page_size + version_number
+        # nonce = prefix / 4b big endian page index / 1b set on the last page
+        last = page_index == page_number - 1
+        nonce = nonce_prefix + struct.pack(">IB", page_index, last)
+        gcm_cipher = AES.new(aes_key, AES.MODE_GCM, nonce=nonce)
+        gcm_cipher.update(page_metadata)
+        encrypted_page = blob[at + 6 + HMAC_SIZE:at + 6 + HMAC_SIZE + len(page)]
+        _, tag = gcm_cipher.encrypt_and_digest(page, output=encrypted_page)
         
+        blob[at:at + 6] = page_metadata
         # Generates a hmac hash of the respective page's metadata
-        fw_metadata_hash = HMAC.new(hmackey, page_metadata, digestmod=SHA256).digest()
+        blob[at + 6:at + 6 + HMAC_SIZE] = mac(hmackey, page_metadata)
         # Generates a hmac hash of the paga data along with the page's metadata (the metadata is added to add another auth/integ check)
-        fw_data_hash = HMAC.new(hmackey, page + page_metadata, digestmod=SHA256).digest()
-        
-        firmware_data += page_metadata + fw_metadata_hash + page + fw_data_hash
-        
-    # At the end of the loop, we append the hmac hash generated above of the entire encrypted firmware
-    firmware_data += fw_hash_total
+        at += 6 + HMAC_SIZE + len(page)
+        # Fed in two parts, so the page is hashed where it is in the blob
+        page_mac = hmac.new(hmackey, encrypted_page, 'sha256')
+        page_mac.update(page_metadata)
+        blob[at:at + HMAC_SIZE] = page_mac.digest()
+        blob[at + HMAC_SIZE:at + HMAC_SIZE + TAG_SIZE] = tag
+    
+    with concurrent.futures.ThreadPoolExecutor(max_workers=threads) as pool:
+        # list() so an exception in any page comes out here
+        list(pool.map(seal_page, range(page_number)))
+    
+    # After the frames, a 32-byte HMAC-SHA256 hash of the entire firmware, the bootloader checks it against flash
+    blob[release_at - HMAC_SIZE:release_at] = mac(hmackey, firmware)
     
     
     # RELEASE MESSAGE
@@ -133,49 +393,145 @@ def protect_firmware(infile, outfile, version, message):
     #   (size determined above)bytes #     32b hmac hash    # 
     #########################################################
     
-    # Encode the release message into bytes
-    rmessage = message.encode()
-    # Generate hmac hash of the release message
-    rmessage_hash = HMAC.new(hmackey, rmessage, digestmod=SHA256).digest()
-    
-    release_message_data = rmessage + rmessage_hash
+    # The release message and its hmac hash
+    at = release_at + len(rmessage)
+    blob[release_at:at] = rmessage
+    blob[at:at + HMAC_SIZE] = mac(hmackey, rmessage)
     
     
     # BIG MAC
     """
-    The big mac is an hmac of the entire encrypted firmware, entire metadata, and release message
+    The big mac is an hmac of the entire firmware, entire metadata, and release message
     This exists to be another authenticity/integrity check on top of the others
     """
     
     ##################################################################
     #                            BIG MAC                             #
     ##################################################################
-    # 32b hmac hash of encrypted firmware, metadata, release message #
+    #      32b hmac hash of firmware, metadata, release message      #
     ##################################################################
     
-    big_data = encrypted_firmware + metadata + rmessage
-    # Generates the hmac
-    big_mac = HMAC.new(hmackey, big_data, digestmod=SHA256).digest()
+    # Fed in parts, so the firmware is not copied to put it in front of the rest
+    big_mac = hmac.new(hmackey, firmware, 'sha256')
+    big_mac.update(metadata)
+    big_mac.update(rmessage)
+    blob[-HMAC_SIZE:] = big_mac.digest()
     
     
-    # BLOB
+    # Write firmware blob to outfile
+    if outfile == '-':
+        sys.stdout.buffer.write(firmware_blob)
+        sys.stdout.buffer.flush()
+    else:
+        with open(outfile, 'wb+') as fp:
+            fp.write(firmware_blob)
+    
+    return firmware_blob
+
+
+# Keys of a batch worker, handed over once when the worker starts
+worker_keys = None
+
+
+def init_worker(keys):
+    global worker_keys
+    worker_keys = keys
+
+
+def protect_job(job):
+    """
+    Protects one manifest entry in a batch worker.
+    Return:
+        Index entry of the blob
     """
-    This is where the blob is created. All chunks from above are combined, back to back, with the AES-GCM iv and tag appended
+    with open(job['infile'], 'rb') as fp:
+        firmware = fp.read()
+    blob = protect_firmware(infile=job['infile'], outfile=job['outfile'], version=int(job['version']),
+                            message=job['message'], base=job.get('base'),
+                            base_version=int(job.get('base_version', 0)), compress=job.get('compress', False),
+                            skip_unchanged=job.get('skip_unchanged', False), keys=worker_keys, threads=1,
+                            firmware=firmware)
+    
+    # The transfer info of the header says how the frames carry the image
+    encoding, payload_size, base_version = struct.unpack_from('<BHH', blob, HEADER_SIZE - 5)
+    return {
+        'outfile': job['outfile'],
+        'version': int(job['version']),
+        'encoding': ENC_NAMES[encoding],
+        'base_version': base_version,
+        'firmware_size': len(firmware),
+        'payload_size': payload_size,
+        'blob_size': len(blob),
+        'frames': ceil(payload_size / PG_SIZE),
+        'firmware_sha256': hashlib.sha256(firmware).hexdigest(),
+        'blob_sha256': hashlib.sha256(blob).hexdigest(),
+    }
+
+
+def protect_batch(manifest, index=None, jobs=None):
+    """
+    Protects every image of a manifest in a pool of jobs workers, with the keys read once.
+    Writes the index of the blobs to index, index.json next to the manifest by default.
+    Return:
+        The index
     """
-    firmware_blob = metadata_and_hash + bytes(firmware_data) + release_message_data + big_mac + iv + tag
+    root = os.path.dirname(os.path.abspath(manifest))
+    with open(manifest) as fp:
+        entries = json.load(fp)
     
+    # Paths in the manifest are relative to it
+    for job in entries:
+        for field in ('infile', 'outfile', 'base'):
+            if job.get(field) is not None:
+                job[field] = os.path.join(root, job[field])
+        if job.get('skip_unchanged') and (job.get('base') is not None or job.get('compress')):
+            raise ValueError(f"{job['infile']}: skip_unchanged cannot be combined with base or compress")
+        if job.get('base') is not None and not int(job.get('base_version', 0)):
+            raise ValueError(f"{job['infile']}: base needs base_version")
     
-    # Write firmware blob to outfile
-    with open(outfile, 'wb+') as outfile:
-        outfile.write(firmware_blob)
+    with concurrent.futures.ProcessPoolExecutor(max_workers=jobs, initializer=init_worker,
+                                                initargs=(load_keys(),)) as pool:
+        results = list(pool.map(protect_job, entries))
+    
+    for r in results:
+        r['outfile'] = os.path.relpath(r['outfile'], root)
+    if index is None:
+        index = os.path.join(root, 'index.json')
+    with open(index, 'w') as fp:
+        json.dump(results, fp, indent=1)
+    return results
 
 
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description='Firmware Update Tool')
-    parser.add_argument("--infile", help="Path to the firmware image to protect.", required=True)
-    parser.add_argument("--outfile", help="Filename for the output firmware.", required=True)
-    parser.add_argument("--version", help="Version number of this firmware.", required=True)
-    parser.add_argument("--message", help="Release message for this firmware.", required=True)
+    parser.add_argument("--infile", help="Path to the firmware image to protect, - for stdin.")
+    parser.add_argument("--outfile", help="Filename for the output firmware, - for stdout.")
+    parser.add_argument("--version", help="Version number of this firmware.")
+    parser.add_argument("--message", help="Release message for this firmware.")
+    parser.add_argument("--base", help="Path to the firmware installed on the device, to send a patch against it.", default=None)
+    parser.add_argument("--base-version", help="Version number of the installed firmware.", default=0)
+    parser.add_argument("--compress", help="Send the firmware LZSS compressed when that is smaller.", action="store_true")
+    parser.add_argument("--skip-unchanged", help="Only send the pages that differ from the device's flash.", action="store_true")
+    parser.add_argument("--batch", help="JSON manifest of many images to protect in parallel, instead of the above.", default=None)
+    parser.add_argument("--index", help="Where the batch index goes, index.json next to the manifest by default.", default=None)
+    parser.add_argument("--jobs", help="Batch processes, or threads sealing pages otherwise. One per CPU by default.",
+                        type=int, default=None)
     args = parser.parse_args()
 
-    protect_firmware(infile=args.infile, outfile=args.outfile, version=int(args.version), message=args.message)
\ No newline at end of file
+    if args.batch is not None:
+        results = protect_batch(args.batch, index=args.index, jobs=args.jobs)
+        for r in results:
+            print(f"{r['outfile']}: v{r['version']} {r['encoding']}, {r['firmware_size']} bytes in "
+                  f"{r['frames']} frames, blob {r['blob_size']} bytes {r['blob_sha256'][:16]}")
+        raise SystemExit(0)
+    if None in (args.infile, args.outfile, args.version, args.message):
+        parser.error("--infile, --outfile, --version and --message are required without --batch")
+
+    if args.base is not None and not int(args.base_version):
+        parser.error("--base needs --base-version")
+    if args.skip_unchanged and (args.base is not None or args.compress):
+        parser.error("--skip-unchanged sends pages as they are, it cannot be combined with --base or --compress")
+
+    protect_firmware(infile=args.infile, outfile=args.outfile, version=int(args.version), message=args.message,
+                     base=args.base, base_version=int(args.base_version), compress=args.compress,
+                     skip_unchanged=args.skip_unchanged, threads=args.jobs)
\ No newline at end of file
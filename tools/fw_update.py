@@ -2,31 +2,61 @@
 """
 Firmware Updater Tool
 
-A frame consists of six sections:
+A frame consists of seven sections:
 1. 2 bytes for the index of the frame
 2. 2 bytes for the size of the frame
 3. 2 bytes for the version number
 4. 32 bytes for an hmac hash of the above metadata
 5. Max 1024 bytes for the encrypted firmware data
 6. 32 bytes for an hmac hash of the above encrypted firmware data
+7. 16 bytes for the aes-gcm tag of this frame
 
-[ 0x02 ][ 0x02 ][ 0x02 ] [ 0x20 ][ ??? ][ 0x20 ]
------------------------------------------------
-| Index | Size | Version | Hash | Data | Hash |
------------------------------------------------
+[ 0x02 ][ 0x02 ][ 0x02 ] [ 0x20 ][ ??? ][ 0x20 ][ 0x10 ]
+-------------------------------------------------------
+| Index | Size | Version | Hash | Data | Hash | Tag  |
+-------------------------------------------------------
+
+Every frame is decrypted and flashed by the bootloader as soon as it is verified.
 
 We write a frame to the bootloader, then wait for it to respond with an
 OK message so we can write the next frame. The OK message in this case is
 just a zero
 
+With --window N the update starts with 'W' and N instead of 'U'. The
+bootloader answers 'W' and the window it grants, and then up to that many
+frames are kept in flight. Each frame is then acknowledged with an OK
+followed by the 2 byte index of the frame, which is cumulative since frames
+are only accepted in order.
+
+Updates start with 'J' and the window instead, unless --no-resume is given.
+The bootloader answers like it does for 'W', and acknowledges the header with
+an OK followed by the 2 byte index of the first frame it still needs. If an
+earlier run of the same update was cut short, the frames it already flashed
+are skipped. With --retries the update is resumed that way after a failure.
+
+A blob made with fw_protect.py --skip-unchanged has a manifest of page hashes
+after the header. The bootloader answers it with an OK and a bitmap of the
+pages that differ from its flash, bit i of byte i/8 for page i, and only those
+frames are sent.
+
+With --baud the update is preceded by 'R' and the proposed rate. After the
+bootloader acks at the old rate both ends switch, the host sends a probe
+that the bootloader echoes, and the host confirms. If any of that fails both
+ends fall back to the old rate on their own.
+
 Before and after the frames are sent, supplementary bytes containing metadata,
 decryption tools, and hashes are sent.
+
+The blob is split into views of these parts once, before anything is sent,
+so a blob with a bad frame is refused up front and no part is ever copied.
 """
 
 import argparse
 import struct
 import time
 
+from collections import deque
+
 from tqdm import tqdm
 import os,binascii
 import random as r
@@ -46,94 +76,359 @@ PG_SIZE = 1024
 FR_MSIZE = 6
 # Hmac hash size is constant, 32 bytes
 HMAC_SIZE = 32
-# Tag and IV for aes-gcm enc/dec are both 16 bytes
+# Tag of each frame's aes-gcm message is 16 bytes
 TAG_SIZE = 16
-IV_SIZE = 16
+# Random nonce prefix sent along with the firmware metadata
+NONCE_PREFIX_SIZE = 7
+# Encoding, payload size and base version sent along with the firmware metadata
+XFER_INFO_SIZE = 5
+# Everything before the header's hmac
+HEADER_SIZE = FW_MSIZE + NONCE_PREFIX_SIZE + XFER_INFO_SIZE
+# Frame acks in windowed mode carry a 2 byte frame index
+ACK_INDEX_SIZE = 2
+# Baud rate the bootloader starts at after every reset
+BAUD_DEFAULT = 115200
+# Sent at a new baud rate and echoed back by the bootloader
+BAUD_PROBE = b'\x55\xaa\x0f\xf0'
+BAUD_CONFIRM = b'C'
+# Time for the bootloader to switch rates, and how long it waits for the probe
+BAUD_SETTLE = 0.01
+BAUD_TIMEOUT = 0.5
+# Encoding of a blob that starts with a page manifest
+ENC_PAGES = 3
+# Time for the bootloader to come back after an error reset it
+RESET_SETTLE = 1.0
+# Zeros that complete any frame the bootloader may still be receiving
+FLUSH_SIZE = FR_MSIZE + PG_SIZE + HMAC_SIZE * 2 + TAG_SIZE
 
 
-def send_data(ser, data, length, debug=False):
+class Blob:
+    """
+    A protected blob split into what is sent at each step of an update, as views of the blob
+    """
+    def __init__(self, data):
+        data = memoryview(data)
+        if len(data) < HEADER_SIZE + HMAC_SIZE:
+            raise RuntimeError(f"ERROR: Blob is {len(data)} bytes, too short for a header")
+        release_size, = struct.unpack_from("<H", data, 4)
+        # How the frames carry the firmware, and the size of what they carry (the firmware itself or a patch for it)
+        self.encoding, payload_size = struct.unpack_from("<BH", data, FW_MSIZE + NONCE_PREFIX_SIZE)
+        # A ceiling function to calculate the total number of pages sent over from fw_protect
+        self.page_number = ceil(payload_size / PG_SIZE)
+
+        self.header = data[:HEADER_SIZE + HMAC_SIZE]
+        pos = len(self.header)
+
+        self.manifest = None
+        if self.encoding == ENC_PAGES:
+            self.manifest = data[pos:pos + self.page_number * HMAC_SIZE + HMAC_SIZE]
+            pos += len(self.manifest)
+
+        # Every frame boundary is checked here, so nothing is sent from a broken blob
+        self.frames = []
+        for i in range(self.page_number):
+            if pos + FR_MSIZE > len(data):
+                raise RuntimeError(f"ERROR: Blob ends before frame {i}")
+            frame_index, frame_size = struct.unpack_from("<HH", data, pos)
+            if frame_index != i:
+                raise RuntimeError(f"ERROR: Frame index incorrect at {i}, data said {frame_index}")
+            if frame_size > PG_SIZE:
+                raise RuntimeError(f"ERROR: Frame {i} says it carries {frame_size} bytes")
+            length = FR_MSIZE + frame_size + HMAC_SIZE * 2 + TAG_SIZE
+            self.frames.append(data[pos:pos + length])
+            pos += length
+
+        if pos + HMAC_SIZE * 3 + release_size != len(data):
+            raise RuntimeError(f"ERROR: Blob is {len(data)} bytes, its parts add up to {pos + HMAC_SIZE * 3 + release_size}")
+        self.image_mac = data[pos:pos + HMAC_SIZE]
+        pos += HMAC_SIZE
+        self.release = data[pos:pos + release_size + HMAC_SIZE]
+        pos += len(self.release)
+        self.big_mac = data[pos:]
+
+
+def send_data(ser, data, debug=False):
     """
     This function is a framework for sending data to the bootloader
     Return:
-        Input (the blob) minus what was just sent over serial
+        None
     """
     
     # Write data to UART
-    ser.write(data[:length])
+    ser.write(data)
     
     # Wait for an OK from the bootloader
     resp = ser.read()  
 
-    time.sleep(0.1)
-
     # If the bootloader responded with anything other than an OK message
     if resp != RESP_OK:
         # Return the error
         raise RuntimeError(f"ERROR: Bootloader responded with {format(repr(resp))}")
+
+
+def wait_for(ser, reply):
+    """
+    Waits for the bootloader to echo a command, skipping whatever came before it.
+    Return:
+        None
+    """
+    while True:
+        resp = ser.read(1)
+        if not resp:
+            raise RuntimeError(f"ERROR: Timed out waiting for the bootloader to answer {reply!r}")
+        if resp == reply:
+            return
+
+
+def recover(ser):
+    """
+    Gets the bootloader back to waiting for a command after an update failed.
+    If it is still receiving something (a byte was lost on the way) the zeros
+    complete it, it fails and resets. Zeros are no command, so they do no harm otherwise.
+    Return:
+        None
+    """
+    ser.write(bytes(FLUSH_SIZE))
+    # The bootloader resets on errors and comes back at the default rate
+    time.sleep(RESET_SETTLE)
+    ser.baudrate = BAUD_DEFAULT
+    ser.reset_input_buffer()
+
+
+def negotiate_baud(ser, baud, debug=False):
+    """
+    Asks the bootloader to switch to a new baud rate and verifies it with a round trip.
+    Return:
+        The baud rate in use afterwards, the old one if the switch failed
+    """
+    old_baud = ser.baudrate
     
-    return data[length:]
+    ser.reset_input_buffer()
+    ser.write(b'R' + struct.pack("<I", baud))
+    wait_for(ser, b'R')
+    
+    # The bootloader refuses rates its UART clock cannot make
+    resp = ser.read()
+    if resp != RESP_OK:
+        if debug:
+            print(f"Bootloader refused {baud} baud, staying at {old_baud}")
+        return old_baud
+    
+    # Switch once the request is out, and give the bootloader time to do the same
+    ser.flush()
+    ser.baudrate = baud
+    time.sleep(BAUD_SETTLE)
+    ser.reset_input_buffer()
+    
+    ser.write(BAUD_PROBE)
+    if ser.read(len(BAUD_PROBE)) == BAUD_PROBE:
+        ser.write(BAUD_CONFIRM)
+        if ser.read() == RESP_OK:
+            if debug:
+                print(f"Switched to {baud} baud")
+            return baud
+    
+    # Wait out the bootloader so it has fallen back as well
+    ser.baudrate = old_baud
+    time.sleep(BAUD_TIMEOUT * 2)
+    ser.reset_input_buffer()
+    if debug:
+        print(f"Could not verify {baud} baud, staying at {old_baud}")
+    return old_baud
+
+
+def wait_frame_ack(ser, in_flight):
+    """
+    Waits for one windowed frame ack and slides the window past every frame it covers.
+    Return:
+        None
+    """
+    resp = ser.read()
+    if resp != RESP_OK:
+        raise RuntimeError(f"ERROR: Bootloader responded with {format(repr(resp))}")
+
+    raw_index = ser.read(ACK_INDEX_SIZE)
+    if len(raw_index) != ACK_INDEX_SIZE:
+        raise RuntimeError("ERROR: Timed out waiting for a frame ack")
+    acked, = struct.unpack("<H", raw_index)
 
+    # Acks are cumulative, anything that is not in flight is out of order
+    if acked not in in_flight:
+        raise RuntimeError(f"ERROR: Bootloader acked frame {acked}, expected {in_flight[0]}")
+    while in_flight and in_flight[0] <= acked:
+        in_flight.popleft()
 
-def main(ser, infile, debug):
+
+def send_manifest(ser, manifest, page_number, debug=False):
     """
-    Sends frames, metadata, hashes, etc. to bootloader
+    Sends the page manifest and reads which pages the bootloader needs.
+    Return:
+        The set of pages to send
     """
+    send_data(ser, manifest, debug=debug)
     
-    # Opened serial port. Set baudrate to 115200. Set timeout to 2 seconds.
+    bitmap = ser.read((page_number + 7) // 8)
+    if len(bitmap) != (page_number + 7) // 8:
+        raise RuntimeError("ERROR: Timed out waiting for the pages the bootloader needs")
+    needed = {i for i in range(page_number) if bitmap[i // 8] >> (i % 8) & 1}
+    if debug:
+        print(f"Bootloader needs {len(needed)} of {page_number} pages")
+    return needed
+
+
+def send_frames_windowed(ser, frames, window, first=0, needed=None, debug=False):
+    """
+    Sends every frame from first on while keeping up to window of them unacknowledged.
+    If needed is given, only the frames in it are sent.
+    Return:
+        None
+    """
+    in_flight = deque()
+
+    for i in tqdm(range(first, len(frames)), unit="pages"):
+        if needed is not None and i not in needed:
+            continue
+
+        # Window is full, wait for the oldest frame first
+        if len(in_flight) == window:
+            wait_frame_ack(ser, in_flight)
+
+        ser.write(frames[i])
+        in_flight.append(i)
+
+    # Drain the remaining acks
+    while in_flight:
+        wait_frame_ack(ser, in_flight)
+
+
+def lap(phases, name, since):
+    """
+    Adds the time since since to phases[name], if phases are collected.
+    Return:
+        The time now, to start the next phase from
+    """
+    now = time.perf_counter()
+    if phases is not None:
+        phases[name] = phases.get(name, 0) + now - since
+    return now
+
+
+def send_update(ser, firmware_blob, debug, window, baud, resume, phases=None):
+    """
+    Sends frames, metadata, hashes, etc. to bootloader, once
+    firmware_blob is the blob, or a Blob already split from it.
+    If phases is a dict, the seconds spent in each part of the update are added to it.
+    """
+    started = time.perf_counter()
     
-    # Read blob that was sent from fw_protect.py
-    with open(infile, 'rb') as fp:
-        firmware_blob = fp.read()
+    # Split the blob into its parts, a Blob may also be passed in already split
+    blob = firmware_blob if isinstance(firmware_blob, Blob) else Blob(firmware_blob)
+    PAGE_NUMBER = blob.page_number
     
-    # Receive size of the entire unencrypted firmware
-    FIRMWARE_SIZE, = struct.unpack("<H", firmware_blob[2:4])
-    # Receive size of release message
-    RELEASE_MESSAGE_SIZE, = struct.unpack("<H", firmware_blob[4:6])
-    # A ceiling function to calculate the total number of pages sent over from fw_protect
-    PAGE_NUMBER = ceil(FIRMWARE_SIZE/PG_SIZE) 
+    # Move to a faster line first if one was asked for
+    if baud != ser.baudrate:
+        negotiate_baud(ser, baud, debug=debug)
+    started = lap(phases, 'baud', started)
     
     # Setting the bootloader to update mode and wait until it is ready
-    ser.write(b'U')
-    while ser.read(1).decode() != 'U':
-        pass
+    if resume:
+        # Like 'W', a window of 1 keeps the plain stop-and-wait acks
+        ser.write(b'J' + struct.pack("<B", min(window, 0xFF)))
+        wait_for(ser, b'J')
+        raw_window = ser.read(1)
+        if len(raw_window) != 1:
+            raise RuntimeError("ERROR: Timed out waiting for the window")
+        window, = struct.unpack("<B", raw_window)
+        if debug:
+            print(f"Bootloader granted a window of {window} frames")
+    elif window > 1:
+        # Propose a window, the bootloader may grant a smaller one
+        ser.write(b'W' + struct.pack("<B", min(window, 0xFF)))
+        wait_for(ser, b'W')
+        raw_window = ser.read(1)
+        if len(raw_window) != 1:
+            raise RuntimeError("ERROR: Timed out waiting for the window")
+        window, = struct.unpack("<B", raw_window)
+        if debug:
+            print(f"Bootloader granted a window of {window} frames")
+    else:
+        ser.write(b'U')
+        wait_for(ser, b'U')
       
-    # Send firmware metadata and HMAC over serial
-    firmware_blob = send_data(ser, firmware_blob, FW_MSIZE + HMAC_SIZE, debug=debug)
+    # Send firmware metadata, nonce prefix, transfer info and HMAC over serial
+    send_data(ser, blob.header, debug=debug)
+    
+    # The bootloader tells us which frame it needs first
+    first = 0
+    if resume:
+        raw_first = ser.read(ACK_INDEX_SIZE)
+        if len(raw_first) != ACK_INDEX_SIZE:
+            raise RuntimeError("ERROR: Timed out waiting for the frame to resume from")
+        first, = struct.unpack("<H", raw_first)
+        if first > PAGE_NUMBER:
+            raise RuntimeError(f"ERROR: Bootloader asked to resume from frame {first} of {PAGE_NUMBER}")
+        if first and debug:
+            print(f"Resuming from frame {first}")
+    
+    # Pages that are already on the device are left out
+    needed = None
+    if blob.manifest is not None:
+        needed = send_manifest(ser, blob.manifest, PAGE_NUMBER, debug=debug)
+    started = lap(phases, 'handshake', started)
     
     # Loop that sends each frame, ends automatically when last frame is sent
-    for i in tqdm(range(PAGE_NUMBER), unit="pages"):
-        # Receive the index of the frame
-        frame_index, = struct.unpack("<H", firmware_blob[:2])
-        # Receive the size of the page
-        FR_OUT, = struct.unpack("<H", firmware_blob[2:4])
-        
-        # Checks if order of received frames aligns with the indexes within the metadata of each frame
-        if frame_index == i:
-            firmware_blob = send_data(ser, firmware_blob, FR_MSIZE + FR_OUT + HMAC_SIZE * 2, debug=debug)
-        else:
-            raise RuntimeError(f"ERROR: Frame index incorrect at {i}, data said {frame_index}") 
-        
-        # Loading bar text
-        print("", end='\r')
+    if window > 1:
+        # Frames are pipelined, acks are collected as the window slides
+        send_frames_windowed(ser, blob.frames, window, first=first, needed=needed, debug=debug)
+    else:
+        for i in tqdm(range(first, PAGE_NUMBER), unit="pages"):
+            if needed is not None and i not in needed:
+                continue
+            
+            # Frame indexes were checked against their order when the blob was split
+            send_data(ser, blob.frames[i], debug=debug)
+            
+            # Loading bar text
+            print("", end='\r')
     # Reset text formatting to default
     print("\033[0m")
+    started = lap(phases, 'frames', started)
     
-    # Send hmac hash of the entire encrypted firmware
-    firmware_blob = send_data(ser, firmware_blob, HMAC_SIZE, debug=debug)
+    # Send hmac hash of the entire firmware
+    send_data(ser, blob.image_mac, debug=debug)
     
     # Send release message along with its hash
-    firmware_blob = send_data(ser, firmware_blob, RELEASE_MESSAGE_SIZE + HMAC_SIZE, debug=debug)
+    send_data(ser, blob.release, debug=debug)
     
     # Send big mac
-    firmware_blob = send_data(ser, firmware_blob, HMAC_SIZE, debug=debug)
-    
-    # Send IV and tag for aes-gcm decryption
-    firmware_blob = send_data(ser, firmware_blob, IV_SIZE + TAG_SIZE, debug=debug)
+    send_data(ser, blob.big_mac, debug=debug)
     
     # Send a zero length payload to tell the bootlader to finish writing its page.
     ser.write(struct.pack('>H', 0x0000))
+    lap(phases, 'finish', started)
 
     return ser
+
+
+def main(ser, infile, debug, window=1, baud=BAUD_DEFAULT, resume=True, retries=0):
+    """
+    Sends the update, resuming it up to retries times if it fails
+    """
+    
+    # Opened serial port. Set baudrate to 115200. Set timeout to 2 seconds.
+    
+    # Read blob that was sent from fw_protect.py, and split it once for every attempt
+    with open(infile, 'rb') as fp:
+        firmware_blob = Blob(fp.read())
+    
+    for attempt in range(retries + 1):
+        try:
+            return send_update(ser, firmware_blob, debug, window, baud, resume)
+        except RuntimeError as e:
+            if not resume or attempt == retries:
+                raise
+            print(f"{e}, resuming")
+            recover(ser)
     
 
 
@@ -143,6 +438,10 @@ if __name__ == '__main__':
     parser.add_argument("--port", help="Serial port to send update over.",required=True)
     parser.add_argument("--firmware", help="Path to firmware image to load.",required=True)
     parser.add_argument("--debug", help="Enable debugging messages.",action='store_true')
+    parser.add_argument("--window", help="Number of frames to keep in flight (1 is stop-and-wait).",type=int,default=1)
+    parser.add_argument("--baud", help="Baud rate to negotiate for the update.",type=int,default=BAUD_DEFAULT)
+    parser.add_argument("--no-resume", help="Always start over instead of resuming an interrupted update.",action='store_true')
+    parser.add_argument("--retries", help="Number of times to resume the update after a failure.",type=int,default=0)
     args = parser.parse_args()
 
     os.system('clear')
@@ -159,8 +458,9 @@ if __name__ == '__main__':
     print('COPYRIGHT © 2021 struct by_lightning{};')
     print('All rights reserved.\n\n\033[1;92m')
     print('Updating bootloader...')
-    ser = Serial(args.port, baudrate=115200, timeout=2)
-    main(ser=ser, infile=args.firmware, debug=args.debug)
+    ser = Serial(args.port, baudrate=BAUD_DEFAULT, timeout=2)
+    main(ser=ser, infile=args.firmware, debug=args.debug, window=args.window, baud=args.baud,
+         resume=not args.no_resume, retries=args.retries)
     print("\n\033[1;91mHack us and you will suffer\n\033[0m")
     
     time.sleep(2)